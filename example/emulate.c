@@ -0,0 +1,111 @@
+/*-
+ *  SPDX-License-Identifier: BSD-3-Clause
+ *
+ *  Copyright (c) 2023, rtegrity ltd. All rights reserved.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <cheritree.h>
+#include "cap.h"
+
+
+/*
+ *  Generate a heap of capabilities in the emulated memory image and
+ *  time a traversal of it. Usage: emulate-example [objects] [links]
+ *  [tree|summary|leaks] [fork]
+ *
+ *  Note: Each object holds a number of capabilities to other objects,
+ *  chosen at random, with the rest of the object holding data. The
+ *  registers are held at the start of the image and refer to the
+ *  first objects. They are the only roots: the stack pointer, the
+ *  stack frames and the other threads are native pointers, which
+ *  can't be represented in the image, so they aren't traversed and
+ *  CHERITREE_OPT_FRAMES and CHERITREE_OPT_ALL_THREADS add no roots.
+ *  The traversal is recursive, but runs on the
+ *  scanner stack, so it doesn't need a large thread stack. The
+ *  scanner stacks are sized for a path through every object. With
+ *  fork, the time is the pause before the traversal is left to a
+ *  child process.
+ */
+#define NREGS       32
+#define MAXSIZE     32
+#define STACKSIZE   512     // Scanner stack per object
+
+
+static void traverse(const char *mode)
+{
+    if (!strcmp(mode, "tree")) cheritree_print_capabilities();
+    else if (!strcmp(mode, "leaks")) cheritree_print_leaks();
+    else cheritree_print_summary();
+}
+
+
+int main(int argc, char **argv)
+{
+    long objects = (argc > 1) ? atol(argv[1]) : 1000000;
+    int links = (argc > 2) ? atoi(argv[2]) : 4;
+    const char *mode = (argc > 3) ? argv[3] : "summary";
+    int perms = CAP_PERM_LOAD | CAP_PERM_STORE | CAP_PERM_LOAD_CAP | CAP_PERM_STORE_CAP;
+    void ***base, **image, **regs;
+    struct timespec start, end;
+    long i, words = NREGS;
+    int j, *size;
+
+    if (objects < 1 || links < 0 || links > MAXSIZE) {
+        fprintf(stderr, "Usage: %s [objects] [links] [tree|summary|leaks] [fork]\n", argv[0]);
+        return 1;
+    }
+
+    base = malloc(objects * sizeof(*base));
+    size = malloc(objects * sizeof(*size));
+
+    srand(1);
+
+    for (i = 0; i < objects; i++) {
+        size[i] = links + 1 + rand() % MAXSIZE;
+        words += size[i];
+    }
+
+    image = (void **)cheritree_emulate_init(words * sizeof(void *));
+    regs = image;
+
+    for (i = 0, words = NREGS; i < objects; i++) {
+        base[i] = &image[words];
+        words += size[i];
+    }
+
+    for (i = 0; i < objects; i++)
+        for (j = 0; j < links; j++) {
+            long k = rand() % objects;
+
+            cheritree_emulate_store(&base[i][j], (addr_t)base[k],
+                (addr_t)base[k], size[k] * sizeof(void *), perms);
+        }
+
+    for (j = 0; j < NREGS && j < objects; j++)
+        cheritree_emulate_store(&regs[j], (addr_t)base[j],
+            (addr_t)base[j], size[j] * sizeof(void *), perms);
+
+    cheritree_emulate_registers(regs, NREGS);
+    cheritree_set_stack_size(objects * STACKSIZE);
+
+    if (argc > 4 && !strcmp(argv[4], "fork"))
+        cheritree_set_options(CHERITREE_OPT_FORK);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    traverse(mode);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    fflush(stdout);
+
+    fprintf(stderr, "%ld objects, %d links: %.3f seconds\n", objects, links,
+        (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9);
+
+    cheritree_flush();
+
+    free(base);
+    free(size);
+    return 0;
+}
@@ -0,0 +1,133 @@
+/*-
+ *  SPDX-License-Identifier: BSD-3-Clause
+ *
+ *  Copyright (c) 2023, rtegrity ltd. All rights reserved.
+ */
+
+#ifndef _CHERITREE_CAP_H_
+#define _CHERITREE_CAP_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include "util.h"
+
+
+/*
+ *  Capability operations.
+ *
+ *  Note: Capabilities are handled through these operations, so that
+ *  the traversal can also be built without CHERI support. A location
+ *  is loaded with cap_load(), and cap_location() derives a pointer to
+ *  an address within the bounds of a capability, or returns NULL if
+ *  that isn't possible.
+ */
+#ifdef __CHERI_PURE_CAPABILITY__
+#include <cheriintrin.h>
+
+#define cap_load(loc)           (*(void **)(loc))
+#define cap_address_get(c)      cheri_address_get(c)
+#define cap_base_get(c)         cheri_base_get(c)
+#define cap_length_get(c)       cheri_length_get(c)
+#define cap_perms_get(c)        cheri_perms_get(c)
+#define cap_is_valid(c)         cheri_is_valid(c)
+#define cap_is_sealed(c)        cheri_is_sealed(c)
+#define cap_is_sentry(c)        cheri_is_sentry(c)
+#define cap_bounds_set(c,n)     cheri_bounds_set((c),(n))
+#define cap_pointer(p)          ((void *)(p))
+#define cap_registers(r,n)      (r)
+#define cap_resident(p,e)       cheritree_page_resident((p),(e))
+#define cap_print(c)            printf("%#p", (c))
+
+#define CAP_PERM_LOAD           CHERI_PERM_LOAD
+#define CAP_PERM_STORE          CHERI_PERM_STORE
+#define CAP_PERM_EXECUTE        CHERI_PERM_EXECUTE
+#define CAP_PERM_LOAD_CAP       CHERI_PERM_LOAD_CAP
+#define CAP_PERM_STORE_CAP      CHERI_PERM_STORE_CAP
+
+
+static inline void **cap_location(void *c, addr_t addr)
+{
+    void **ptr = (void **)((char *)c + (addr - cheri_address_get(c)));
+
+    if (!cheri_is_valid(ptr)) return NULL;
+    if (addr < cheri_base_get(ptr)) return NULL;
+    if (addr >= cheri_base_get(ptr) + cheri_length_get(ptr)) return NULL;
+    return ptr;
+}
+
+
+#else
+
+/*
+ *  Software emulation.
+ *
+ *  Note: Without CHERI support, capabilities are emulated in a
+ *  synthetic memory image. Each word of the image holds an address,
+ *  and a shadow word holds the compressed bounds and permissions of
+ *  the capability, with a shadow bitmap holding its tag. A loaded
+ *  capability is represented by its location in the image, so the
+ *  traversal handles it in the same way as a native capability.
+ *  Native pointers aren't capabilities, and capabilities can't be
+ *  derived from them, so roots such as the stack pointer, threads
+ *  and stack frames are only available natively. The image is
+ *  treated as resident, since its untouched pages hold no tags.
+ *  Alternatively,
+ *  the memory of another process can be read through a reader, in
+ *  which case any address within a readable mapping is a pointer,
+ *  bounded by the mapping.
+ */
+typedef struct cap {
+    addr_t address;             // Address
+    uint64_t bounds;            // Compressed bounds and permissions
+} cap_t;
+
+void *cheritree_emulate_init(size_t size);
+int cheritree_emulate_store(void **loc, addr_t address,
+    addr_t base, addr_t length, int perms);
+void cheritree_emulate_clear(void **loc);
+void cheritree_emulate_registers(void **regs, int nregs);
+typedef int (*cheritree_reader_t)(addr_t addr, void *buf, size_t len);
+void cheritree_emulate_remote(cheritree_reader_t read);
+addr_t cheritree_emulate_address(const void *c);
+void **cheritree_emulate_substitute(void **regs, int *nregs);
+int cheritree_emulate_get(const void *c, cap_t *cap);
+addr_t cheritree_emulate_base(const void *c);
+addr_t cheritree_emulate_length(const void *c);
+int cheritree_emulate_perms(const void *c);
+int cheritree_emulate_resident(void *ptr, addr_t *pend);
+
+#define cap_load(loc)           ((void *)(loc))
+#define cap_address_get(c)      cheritree_emulate_address(c)
+#define cap_base_get(c)         cheritree_emulate_base(c)
+#define cap_length_get(c)       cheritree_emulate_length(c)
+#define cap_perms_get(c)        (cheritree_emulate_perms(c) & CAP_PERM_MASK)
+#define cap_is_valid(c)         (cheritree_emulate_get((c), NULL))
+#define cap_is_sealed(c)        ((cheritree_emulate_perms(c) & CAP_SEALED) != 0)
+#define cap_is_sentry(c)        ((cheritree_emulate_perms(c) & CAP_SENTRY) != 0)
+#define cap_bounds_set(c,n)     ((void *)NULL)
+#define cap_pointer(p)          ((void *)NULL)
+#define cap_registers(r,n)      cheritree_emulate_substitute((r), (n))
+#define cap_resident(p,e)       cheritree_emulate_resident((p),(e))
+#define cap_location(c,a)       ((void **)(uintptr_t)(a))
+
+#define cap_print(c)            printf("%#" PRIxADDR " [%#" PRIxADDR "-%#" PRIxADDR "]", \
+                                    cap_address_get(c), cap_base_get(c), \
+                                    cap_base_get(c) + cap_length_get(c))
+
+#define CAP_PERM_LOAD           0x01
+#define CAP_PERM_STORE          0x02
+#define CAP_PERM_EXECUTE        0x04
+#define CAP_PERM_LOAD_CAP       0x08
+#define CAP_PERM_STORE_CAP      0x10
+#define CAP_PERM_MASK           0x1f
+#define CAP_SEALED              0x20
+#define CAP_SENTRY              0x40
+
+#endif /* __CHERI_PURE_CAPABILITY__ */
+
+
+#define cap_align_up(x,a)       (((x) + (a) - 1) & ~((addr_t)(a) - 1))
+#define cap_align_down(x,a)     ((x) & ~((addr_t)(a) - 1))
+
+
+#endif /* _CHERITREE_CAP_H_ */
@@ -8,35 +8,160 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <ucontext.h>
 #include <setjmp.h>
 #include <inttypes.h>
 #include <limits.h>
 #include <string.h>
-#ifdef __CHERI_PURE_CAPABILITY__
-#include <cheriintrin.h>
-#endif
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include "cheritree.h"
+#include "cap.h"
 #include "mapping.h"
 #include "symbol.h"
+#include "page.h"
+#include "thread.h"
+#include "writer.h"
+#include "heap.h"
+#include "filter.h"
+#include "stack.h"
 
 
-void _cheritree_init(void *function, void *stack)
+/*
+ *  Heap objects are only available with the allocator shim.
+ */
+#pragma weak cheritree_heap_find
+#pragma weak cheritree_heap_page
+
+
+static int options;
+static int paging;
+static pid_t child;
+static __thread vec_t forked;
+static vec_t *filters;
+static int filtering;
+
+
+int cheritree_set_options(int flags)
+{
+    int previous = options;
+
+    options = flags;
+    return previous;
+}
+
+
+/*
+ *  Set the filter, replacing any filter from the environment.
+ *  Returns zero, leaving the filter unchanged, if it is invalid.
+ */
+int cheritree_set_filter(const char *filter)
+{
+    vec_t v;
+
+    __atomic_store_n(&filtering, 1, __ATOMIC_RELEASE);
+    cheritree_vec_init(&v, sizeof(filter_t), 8);
+
+    if (filter && !cheritree_filter_compile(filter, &v)) {
+        cheritree_vec_delete(&v);
+        return 0;
+    }
+
+    cheritree_vec_publish(&filters, &v);
+    return 1;
+}
+
+
+/*
+ *  Load the filter from CHERITREE_FILTER, unless it has been set.
+ */
+static void load_filter()
+{
+    const char *cp;
+    int unset = 0;
+
+    if (!__atomic_compare_exchange_n(&filtering, &unset, 1,
+            0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+        return;
+
+    if ((cp = getenv("CHERITREE_FILTER")) != NULL && !cheritree_set_filter(cp))
+        fprintf(stderr, "CheriTree: Invalid filter \"%s\"\n", cp);
+}
+
+
+static void init_stack(addr_t function, void *stack)
 {
     mapping_t *functionmap, *stackmap;
+    int epoch = cheritree_read_begin();
     const char *owner;
     
-    functionmap = cheritree_resolve_mapping((addr_t)function);
+    functionmap = cheritree_resolve_mapping(function);
     owner = getname(functionmap);
 
     stackmap = cheritree_resolve_mapping((addr_t)stack);
     cheritree_set_mapping_name(stackmap, owner, "stack");
+    cheritree_read_end(epoch);
 }
 
 
-static void print_address(void *vaddr, char *name, void **origin, int depth)
+void _cheritree_init(void *function, void *stack)
 {
-    addr_t addr = (addr_t)cheri_address_get(vaddr);
-    mapping_t *mapping = cheritree_resolve_mapping(addr);
-    symbol_t *symbol;
+    init_stack((addr_t)function, stack);
+}
+
+
+/*
+ *  Find the end of the stub's frame, which is the caller's stack
+ *  pointer, three slots above the stub's frame pointer in regs[32].
+ */
+static addr_t get_stub_end(void **regs, int nregs)
+{
+    addr_t end = (addr_t)(regs + nregs);
+
+    if (nregs > 32 && (addr_t)((void **)regs[32] + 3) > end)
+        end = (addr_t)((void **)regs[32] + 3);
+
+    return end;
+}
+
+
+/*
+ *  Print the size and call site of a heap object, if the
+ *  capability refers to a live allocation.
+ */
+static void print_heap_object(void *vaddr)
+{
+    char buf[SYMBOL_NAMELEN];
+    heap_object_t object;
+    mapping_t *mapping;
+    symbol_t symbol;
+
+    if (cheritree_heap_find &&
+            cheritree_heap_find(cap_base_get(vaddr), &object)) {
+        mapping = cheritree_find_mapping(object.site);
+
+        if (!mapping || !cheritree_find_symbol(getpath(mapping),
+                getbase(mapping), object.site, &symbol))
+            symbol.image = NULL;
+
+        printf(" (%#" PRIxADDR " bytes from %s!%s)", object.size,
+            getname(mapping), (symbol.image) ?
+            cheritree_symbol_name(&symbol, buf, sizeof(buf)) : "?");
+    }
+
+    putc('\n', stdout);
+}
+
+
+static void print_resolved_address(void *vaddr, const char *name,
+    void **origin, int depth, mapping_t *mapping, symbol_t *symbol)
+{
+    addr_t addr = (addr_t)cap_address_get(vaddr);
+    char buf[SYMBOL_NAMELEN];
+    const char *symname;
     addr_t offset;
     int i;
 
@@ -46,49 +171,122 @@ static void print_address(void *vaddr, char *name, void **origin, int depth)
     else printf("%s ", name);
 
     if (!mapping || !*getname(mapping)) {
-        printf("%#p\n", vaddr);
+        cap_print(vaddr);
+        print_heap_object(vaddr);
         return;
     }
 
-    symbol = cheritree_find_symbol(getpath(mapping), getbase(mapping), addr);
     offset = addr - (addr_t)getbase(mapping);
 
-    printf("%#p  ", vaddr);
+    cap_print(vaddr);
+    printf("  ");
+
+    symname = cheritree_symbol_name(symbol, buf, sizeof(buf));
 
-    if (!*getpath(mapping) || !symbol || !*getname(symbol)) {
+    if (!*getpath(mapping) || !*symname) {
         if (*getname(mapping) == '[')
-            printf("%s+%#" PRIxADDR "\n", getname(mapping), offset);
+            printf("%s+%#" PRIxADDR, getname(mapping), offset);
 
-        else printf("%s!%#" PRIxADDR "\n", getname(mapping), offset);
-        return;
+        else printf("%s!%#" PRIxADDR, getname(mapping), offset);
     }
 
-    offset -= symbol->value;
+    else if ((offset -= symbol->value) != 0)
+        printf("%s!%s+%#" PRIxADDR, getname(mapping), symname, offset);
 
-    if (offset)
-        printf("%s!%s+%#" PRIxADDR "\n", getname(mapping), getname(symbol), offset);
+    else printf("%s!%s", getname(mapping), symname);
 
-    else printf("%s!%s\n", getname(mapping), getname(symbol));
+    print_heap_object(vaddr);
 }
 
 
-static int get_pointer_range(void *vaddr, void ***pstart, uintptr_t *pend)
+static void print_mapped_address(void *vaddr, const char *name,
+    void **origin, int depth, mapping_t *mapping)
 {
-    uintptr_t end;
-    void **ptr;
+    addr_t addr = (addr_t)cap_address_get(vaddr);
+    symbol_t symbol;
+
+    if (!mapping || !cheritree_find_symbol(getpath(mapping),
+            getbase(mapping), addr, &symbol))
+        symbol.image = NULL;
+
+    print_resolved_address(vaddr, name, origin, depth, mapping, &symbol);
+}
+
+
+/*
+ *  Print an address, without resolving it for raw output.
+ */
+static void print_address(void *vaddr, const char *name, void **origin, int depth)
+{
+    addr_t addr = (addr_t)cap_address_get(vaddr);
 
-    if (cheri_is_sentry(vaddr)) return 0;
+    print_mapped_address(vaddr, name, origin, depth,
+        (options & CHERITREE_OPT_RAW) ? NULL : cheritree_resolve_mapping(addr));
+}
+
+
+/*
+ *  Record passed to the background writer.
+ *
+ *  Note: The writer doesn't reload the mappings, since they are
+ *  only updated by the traversal, but the version it reads must
+ *  not be freed while it is being used.
+ */
+typedef struct record {
+    void *vaddr;            // Capability, or NULL at end
+    void **origin;          // Location of capability
+    char name[20];          // Root name
+    int depth;              // Depth in tree
+    addr_t skipped;         // Bytes skipped (at end)
+    addr_t avoided;         // Bytes not resident (at end)
+    addr_t freed;           // Bytes freed (at end)
+} record_t;
+
+
+static void print_skipped(addr_t skipped, addr_t avoided, addr_t freed)
+{
+    if (skipped)
+        printf("Skipped %#" PRIxADDR " bytes that can't hold capabilities\n",
+            skipped);
+
+    if (avoided)
+        printf("Skipped %#" PRIxADDR " bytes that aren't resident\n", avoided);
+
+    if (freed)
+        printf("Skipped %#" PRIxADDR " bytes of freed heap pages\n", freed);
+}
+
+
+static void write_record(void *rp)
+{
+    record_t *record = (record_t *)rp;
+    addr_t addr = (addr_t)cap_address_get(record->vaddr);
+    int epoch;
+
+    if (!record->vaddr) {
+        print_skipped(record->skipped, record->avoided, record->freed);
+        return;
+    }
+
+    epoch = cheritree_read_begin();
+    print_mapped_address(record->vaddr, record->name, record->origin, record->depth,
+        (options & CHERITREE_OPT_RAW) ? NULL : cheritree_find_mapping(addr));
+
+    cheritree_read_end(epoch);
+}
 
-    ptr = (void **)((char *)vaddr - ((addr_t)vaddr -
-        cheri_align_up(cheri_base_get(vaddr), sizeof(void *))));
 
-    end = cheri_align_down(cheri_base_get(ptr) +
-         cheri_length_get(ptr), sizeof(void *));
+static int get_pointer_range(void *vaddr, void ***pstart, uintptr_t *pend)
+{
+    addr_t start, end;
+    void **ptr;
+
+    if (cap_is_sentry(vaddr)) return 0;
 
-    if (!cheri_is_valid(ptr)) return 0;
-    if (cheri_base_get(ptr) > cheri_address_get(ptr)) return 0;
+    start = cap_align_up(cap_base_get(vaddr), sizeof(void *));
+    end = cap_align_down(cap_base_get(vaddr) + cap_length_get(vaddr), sizeof(void *));
 
-    if (cheri_address_get(ptr) >= cheri_base_get(ptr) + cheri_length_get(ptr))
+    if (start >= end || (ptr = cap_location(vaddr, start)) == NULL)
         return 0;
 
     *pstart = ptr;
@@ -99,75 +297,1642 @@ static int get_pointer_range(void *vaddr, void ***pstart, uintptr_t *pend)
 
 static int is_printed(map_t *map, void *addr)
 {
-    addr_t start = cheri_base_get(addr);
-    addr_t end = start + cheri_length_get(addr);
+    addr_t start = cap_base_get(addr);
+    addr_t end = start + cap_length_get(addr);
 
     return !cheritree_map_add(map, start, end);
 }
 
 
-static int is_exclude(map_t *exclude, void ***pptr)
+/*
+ *  Traversal state.
+ */
+typedef struct traversal {
+    map_t map;              // Printed ranges
+    map_t exclude;          // Excluded ranges
+    vec_t roots;            // Root capabilities
+    string_t owner;         // Owner of caller
+    int epoch;              // Reader epoch
+    int tracking;           // Tracking pages
+    int writing;            // Using background writer
+    addr_t skipped;         // Bytes that can't hold capabilities
+    addr_t avoided;         // Bytes that aren't resident
+    addr_t freed;           // Bytes of freed heap pages
+    vec_t outputs;          // Deferred output
+    int batching;           // Deferring output
+    vec_t *filters;         // Filter clauses
+} traversal_t;
+
+typedef struct root {
+    void *vaddr;            // Capability
+    string_t ownerstr;      // Owner of capability
+    char name[20];          // Name
+} root_t;
+
+#define getroot(v,i)        ((root_t *)cheritree_vec_get((v),(i)))
+
+
+/*
+ *  Scan of the locations within the bounds of a capability.
+ *
+ *  Note: When tracking pages, only locations that are known to hold
+ *  a capability, or that have been written since the last scan, are
+ *  dereferenced. Mappings that can't hold capabilities are skipped
+ *  as a whole, and so are pages that aren't resident, since reading
+ *  them would fault in zero pages. With the allocator shim, a scan
+ *  of a heap object is limited to its size, and heap pages that only
+ *  hold freed memory are skipped. The skipped bytes are counted.
+ *  These checks are made once for each run of locations, rather
+ *  than for every location.
+ */
+typedef struct scan {
+    void **ptr;             // Next location
+    uintptr_t end;          // End of range
+    uintptr_t checked;      // End of checked run
+    uintptr_t resident;     // End of resident pages
+    map_t *exclude;         // Excluded ranges
+    int page;               // Tracked page (index)
+    int tracking;           // Tracking pages
+    addr_t *skipped;        // Bytes skipped
+    addr_t *avoided;        // Bytes not resident
+    addr_t *freed;          // Bytes of freed heap pages
+    cursor_t cursor;        // Current mapping
+} scan_t;
+
+
+static int scan_init(scan_t *scan, traversal_t *t, void *vaddr)
+{
+    scan->exclude = &t->exclude;
+    scan->checked = 0;
+    scan->resident = 0;
+    scan->page = -1;
+    scan->tracking = t->tracking;
+    scan->skipped = &t->skipped;
+    scan->avoided = &t->avoided;
+    scan->freed = &t->freed;
+    memset(&scan->cursor, 0, sizeof(scan->cursor));
+
+    if (!get_pointer_range(vaddr, &scan->ptr, &scan->end))
+        return 0;
+
+    if (cheritree_heap_find) {
+        heap_object_t object;
+
+        if (cheritree_heap_find(cap_base_get(vaddr), &object) &&
+                object.start + object.size < scan->end)
+            scan->end = cap_align_up(object.start + object.size, sizeof(void *));
+    }
+
+    return 1;
+}
+
+
+/*
+ *  Skip to the end of a run that can't hold capabilities, counting
+ *  the bytes skipped. The location is left before the end, since
+ *  the scan then moves to the next location.
+ */
+static int scan_skip(scan_t *scan, addr_t end, addr_t *count)
+{
+    addr_t addr = (addr_t)scan->ptr;
+
+    if (end > scan->end) end = scan->end;
+    end = cap_align_up(end, sizeof(void *));
+
+    if (end <= addr) end = addr + sizeof(void *);
+    if (count) *count += end - addr;
+
+    scan->ptr += (end - addr) / sizeof(void *) - 1;
+    return 0;
+}
+
+
+/*
+ *  Check the run of locations from the next one. Returns zero,
+ *  skipping the run, if it can't hold capabilities.
+ *
+ *  Note: The run ends at the first boundary of the mapping, an
+ *  excluded range, a heap page, the resident pages or a tracked
+ *  page, so the locations within it need no further checks. The
+ *  mapping cursor is only moved when the scan crosses its end.
+ */
+static int scan_check(scan_t *scan)
 {
-    addr_t addr = (addr_t)*pptr;
+    addr_t addr = (addr_t)scan->ptr, end = scan->end;
+    int pagesize = getpagesize();
     range_t range;
 
-    if (!cheritree_map_find(exclude, addr, &range))
-        return 0;
+    if (addr >= scan->cursor.end &&
+            !cheritree_cursor_seek(&scan->cursor, addr))
+        return scan_skip(scan, scan->cursor.end, scan->skipped);
+
+    if (scan->cursor.end < end) end = scan->cursor.end;
+
+    if (cheritree_map_next(scan->exclude, addr, &range)) {
+        if (range.start <= addr) return scan_skip(scan, range.end, NULL);
+        if (range.start < end) end = range.start;
+    }
+
+    // The residency is read for many pages at once, so it is kept
+    // across runs that end at page boundaries
+
+    if (addr >= scan->resident) {
+        addr_t resident = end;
+
+        if (!cap_resident(scan->ptr, &resident))
+            return scan_skip(scan, resident, scan->avoided);
+
+        scan->resident = resident;
+    }
+
+    if (scan->resident < end) end = scan->resident;
 
-    *(char **)pptr += (range.end - sizeof(void *)) - addr;
+    if (scan->tracking || cheritree_heap_page) {
+        addr_t next = (addr & ~(addr_t)(pagesize - 1)) + pagesize;
+
+        if (cheritree_heap_page && cheritree_heap_page(addr) == 0)
+            return scan_skip(scan, next, scan->freed);
+
+        if (next < end) end = next;
+    }
+
+    if (scan->tracking) scan->page = cheritree_page_find(addr);
+
+    scan->checked = end;
     return 1;
 }
 
 
-static void print_capability_tree(map_t *map, map_t *exclude,
-    void *vaddr, char *name, void **origin, int depth)
+static int scan_next(scan_t *scan, void ***pptr, void **pvaddr)
+{
+    int known, valid;
+    void *p;
+
+    for (; (uintptr_t)scan->ptr < scan->end; scan->ptr++) {
+        if ((uintptr_t)scan->ptr >= scan->checked && !scan_check(scan))
+            continue;
+
+        // Only the slots that need to be scanned or are known to hold
+        // a capability are loaded from a tracked page
+
+        if (scan->tracking) {
+            addr_t addr = (addr_t)scan->ptr;
+            addr_t next = cheritree_page_next(scan->page, addr, scan->checked);
+
+            if (next > addr) {
+                scan->ptr += (next - addr) / sizeof(void *) - 1;
+                continue;
+            }
+        }
+
+        known = (scan->tracking) ?
+            cheritree_page_test(scan->page, (addr_t)scan->ptr) : -1;
+
+        p = cap_load(scan->ptr);
+
+        valid = cap_is_valid(p);
+
+        if (known < 0 && scan->tracking)
+            cheritree_page_record(scan->page, (addr_t)scan->ptr, valid);
+
+        if (valid) {
+            *pptr = scan->ptr++;
+            *pvaddr = p;
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+
+/*
+ *  Deferred symbolization.
+ *
+ *  Note: Records are collected during the traversal and resolved
+ *  afterwards in address order, with a single pass through the
+ *  mappings and through the symbols of each image. They are then
+ *  printed in their original order.
+ */
+typedef struct output {
+    record_t record;        // Output record
+    mapping_t *mapping;     // Resolved mapping
+    symbol_t symbol;        // Resolved symbol
+} output_t;
+
+typedef struct order {
+    addr_t addr;            // Address
+    int index;              // Output index
+} order_t;
+
+#define getoutput(v,i)      ((output_t *)cheritree_vec_get((v),(i)))
+#define getorder(v,i)       ((order_t *)cheritree_vec_get((v),(i)))
+
+
+static int compare_order(const void *a, const void *b)
+{
+    addr_t x = ((const order_t *)a)->addr, y = ((const order_t *)b)->addr;
+
+    return (x > y) - (x < y);
+}
+
+
+static void resolve_outputs(vec_t *outputs)
+{
+    int n = getcount(outputs), i, j;
+    vec_t order, addrs, mappings, symbols;
+    mapping_t **mp;
+    symbol_t *sp;
+    addr_t *ap;
+
+    if (!n) return;
+
+    cheritree_vec_init(&order, sizeof(order_t), n);
+    cheritree_vec_init(&addrs, sizeof(addr_t), n);
+    cheritree_vec_init(&mappings, sizeof(mapping_t *), n);
+    cheritree_vec_init(&symbols, sizeof(symbol_t), n);
+
+    cheritree_vec_alloc(&order, n);
+    ap = (addr_t *)cheritree_vec_alloc(&addrs, n);
+    mp = (mapping_t **)cheritree_vec_alloc(&mappings, n);
+    sp = (symbol_t *)cheritree_vec_alloc(&symbols, n);
+
+    for (i = 0; i < n; i++) {
+        sp[i].image = NULL;
+        getorder(&order, i)->addr = cap_address_get(getoutput(outputs, i)->record.vaddr);
+        getorder(&order, i)->index = i;
+    }
+
+    qsort(order.addr, n, sizeof(order_t), compare_order);
+
+    for (i = 0; i < n; i++)
+        ap[i] = getorder(&order, i)->addr;
+
+    cheritree_find_mappings(ap, n, mp);
+
+    // Resolve any new mappings individually
+
+    for (i = 0; i < n; i++)
+        if (!mp[i]) mp[i] = cheritree_resolve_mapping(ap[i]);
+
+    // Resolve the symbols for each run of addresses in an image
+
+    for (i = 0; i < n; i = j) {
+        for (j = i + 1; j < n && mp[j] && mp[i] &&
+            getbase(mp[j]) == getbase(mp[i]); j++);
+
+        if (mp[i] && *getpath(mp[i]))
+            cheritree_find_symbols(getpath(mp[i]),
+                getbase(mp[i]), &ap[i], j - i, &sp[i]);
+    }
+
+    for (i = 0; i < n; i++) {
+        output_t *output = getoutput(outputs, getorder(&order, i)->index);
+
+        output->mapping = mp[i];
+        output->symbol = sp[i];
+    }
+
+    cheritree_vec_delete(&order);
+    cheritree_vec_delete(&addrs);
+    cheritree_vec_delete(&mappings);
+    cheritree_vec_delete(&symbols);
+}
+
+
+static void print_outputs(vec_t *outputs)
+{
+    int i;
+
+    if (!(options & CHERITREE_OPT_RAW))
+        resolve_outputs(outputs);
+
+    for (i = 0; i < getcount(outputs); i++) {
+        output_t *output = getoutput(outputs, i);
+        record_t *record = &output->record;
+
+        print_resolved_address(record->vaddr, record->name, record->origin,
+            record->depth, output->mapping, &output->symbol);
+    }
+}
+
+
+static void output_address(traversal_t *t,
+    void *vaddr, const char *name, void **origin, int depth)
+{
+    record_t *record, buf;
+
+    if (!t->writing && !t->batching) {
+        print_address(vaddr, name, origin, depth);
+        return;
+    }
+
+    record = (t->batching) ?
+        &((output_t *)cheritree_vec_alloc(&t->outputs, 1))->record : &buf;
+
+    memset(record, 0, sizeof(*record));
+    record->vaddr = vaddr;
+    record->origin = origin;
+    record->depth = depth;
+    strncpy(record->name, name, sizeof(record->name) - 1);
+
+    if (t->writing) cheritree_writer_push(record);
+}
+
+
+/*
+ *  Walk the tree from a capability, calling the visitor for each
+ *  capability that isn't hidden or pruned by the filter.
+ *
+ *  Note: The visitor returns zero to skip the capabilities below
+ *  the one visited. Each range is only scanned once, so the walk
+ *  doesn't allocate other than to record the scanned ranges. The
+ *  filter is tested once for each capability, before its range is
+ *  recorded, and the result is passed down.
+ */
+typedef int (*visit_fn)(void *ctx, const char *name,
+    void **origin, void *vaddr, int depth);
+
+
+static void walk_tree(traversal_t *t, void *vaddr, int filter,
+    const char *name, void **origin, int depth, visit_fn visit, void *ctx)
 {
     void **ptr, *p;
-    uintptr_t end;
-    
-    if (!cheri_is_valid(vaddr)) return;
+    scan_t scan;
+
+    if (!(filter & CT_FILTER_HIDE) && !visit(ctx, name, origin, vaddr, depth))
+        return;
 
-    print_address(vaddr, name, origin, depth);
+    if (!depth && is_printed(&t->map, vaddr)) return;
 
-    if (!depth && is_printed(map, vaddr)) return;
+    if (scan_init(&scan, t, vaddr))
+        while (scan_next(&scan, &ptr, &p)) {
+            filter = cheritree_filter_test(t->filters, p);
 
-    if (get_pointer_range(vaddr, &ptr, &end))
-        for (; (uintptr_t)ptr < end; ptr++)
-            if (cheritree_dereference_address(&ptr, &p) && !is_exclude(exclude, &ptr))
-                if (cheri_is_valid(p) && !is_printed(map, p))
-                    print_capability_tree(map, exclude, p, name, ptr, depth+1);
+            if (!(filter & CT_FILTER_PRUNE) && !is_printed(&t->map, p))
+                walk_tree(t, p, filter, name, ptr, depth+1, visit, ctx);
+        }
 }
 
 
-void _cheritree_print_capabilities(void **regs, int nregs)
+static void walk_roots(traversal_t *t, visit_fn visit, void *ctx)
 {
-    map_t map, exclude;
-    mapping_t *stack;
-    char reg[20];
     int i;
 
-    if (nregs > 30)
-        _cheritree_init(regs[30], regs);
+    for (i = 0; i < getcount(&t->roots); i++) {
+        root_t *root = getroot(&t->roots, i);
+        int filter;
+
+        if (!cap_is_valid(root->vaddr)) continue;
+
+        filter = cheritree_filter_test(t->filters, root->vaddr);
+
+        if (!(filter & CT_FILTER_PRUNE))
+            walk_tree(t, root->vaddr, filter, root->name, NULL, 0, visit, ctx);
+    }
+}
+
+
+static int print_visitor(void *ctx, const char *name,
+    void **origin, void *vaddr, int depth)
+{
+    output_address((traversal_t *)ctx, vaddr, name, origin, depth);
+    return 1;
+}
+
+
+static void add_root(traversal_t *t, void *vaddr,
+    string_t owner, const char *name)
+{
+    root_t *root;
+
+    if (!cap_is_valid(vaddr)) return;
+
+    root = (root_t *)cheritree_vec_alloc(&t->roots, 1);
+    root->vaddr = vaddr;
+    root->ownerstr = owner;
+    snprintf(root->name, sizeof(root->name), "%s", name);
+}
+
+
+/*
+ *  Add the saved registers of the other threads as roots.
+ *
+ *  Note: The threads continue once their registers have been
+ *  captured. Each capability in the saved registers is added as a
+ *  separate root, named by its thread, and the roots are scanned
+ *  one after another. The saved registers are then cleared, so that
+ *  no copies of the capabilities are left in the heap. In a child
+ *  started by fork_traversal(), the threads captured by the parent
+ *  before the fork are used, since only the caller runs in the child.
+ */
+static void release_threads(vec_t *threads)
+{
+    if (threads->addr) memset(threads->addr, 0, threads->maxcount * threads->size);
+    cheritree_vec_delete(threads);
+}
+
+
+static void add_thread_roots(traversal_t *t)
+{
+    vec_t threads = forked;
+    char name[20];
+    size_t j;
+    int i;
+
+    if (threads.addr) memset(&forked, 0, sizeof(forked));
+
+    else {
+        cheritree_vec_init(&threads, sizeof(thread_t), 16);
+        cheritree_capture_threads(&threads);
+    }
+
+    for (i = 0; i < getcount(&threads); i++) {
+        thread_t *thread = getthread(&threads, i);
+        void **context = (void **)&thread->context;
+        mapping_t *stack;
+
+        if (thread->state != THREAD_CAPTURED) continue;
+
+        sprintf(name, "stack %d", thread->tid);
+        stack = cheritree_resolve_mapping(thread->stack);
+        cheritree_set_mapping_name(stack, NULL, name);
+
+        sprintf(name, "t%d", thread->tid);
+
+        for (j = 0; j < sizeof(thread->context) / sizeof(void *); j++)
+            add_root(t, cap_load(&context[j]), getownerstr(stack), name);
+    }
+
+    release_threads(&threads);
+}
+
+
+/*
+ *  Add the live stack frames as roots, in place of the stack.
+ *
+ *  Note: Frame records are followed from the saved frame pointer.
+ *  The frame record is placed above the locals, so each frame runs
+ *  from the end of the previous frame to the end of its own record,
+ *  and is named by the function holding the return address from the
+ *  previous frame. The stack below the caller is excluded.
+ */
+static void add_frame_roots(traversal_t *t,
+    void **regs, string_t owner, mapping_t *stack)
+{
+    void **start = (void **)cap_load(&regs[32]) + 3;
+    void **fp = (void **)cap_load(&regs[29]);
+    void *lr = cap_load(&regs[30]);
+    char name[20];
+    int i;
+
+    cheritree_map_add(&t->exclude, stack->start, (addr_t)start);
+
+    for (i = 0; cap_is_valid(fp) && fp >= start &&
+            (addr_t)(fp + 2) <= stack->end; i++) {
+        addr_t addr = cap_address_get(lr);
+        mapping_t *mapping = cheritree_resolve_mapping(addr);
+        symbol_t symbol;
 
-    cheritree_map_init(&map, 1024);
-    cheritree_map_init(&exclude, 100);
+        if (mapping && cheritree_find_symbol(getpath(mapping),
+                getbase(mapping), addr, &symbol))
+            cheritree_symbol_name(&symbol, name, sizeof(name));
 
-    // Exclude cheritree stack frames
+        else name[0] = 0;
 
-    stack = cheritree_resolve_mapping((addr_t)regs);
-    cheritree_map_add(&exclude, (stack) ? stack->start : (addr_t)regs,
-        (addr_t)(regs + nregs));
+        if (!*name)
+            sprintf(name, "frame%d", i);
 
-    print_capability_tree(&map, &exclude, regs, "csp", NULL, 0);
+        add_root(t, cap_bounds_set(start,
+            (char *)(fp + 2) - (char *)start), owner, name);
 
-    for (i = 0; i < nregs && i < 31; i++) {
-        sprintf(reg, "c%d", i);
-        print_capability_tree(&map, &exclude, regs[i], reg, NULL, 0);
+        start = fp + 2;
+        lr = cap_load(&fp[1]);
+        fp = (void **)cap_load(&fp[0]);
     }
+}
+
+
+static void get_register_name(int index, char *name)
+{
+    if (index < 0) strcpy(name, "csp");
+    else if (index < 31) sprintf(name, "c%d", index);
+    else strcpy(name, cheritree_is_remote() ? "csp" : "ddc");
+}
+
+
+/*
+ *  Start tracking pages, unless another traversal is already
+ *  tracking them.
+ */
+static int begin_tracking()
+{
+    int idle = 0;
+
+    if (!__atomic_compare_exchange_n(&paging, &idle, 1,
+            0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+        return 0;
+
+    if (cheritree_page_begin()) return 1;
+
+    __atomic_store_n(&paging, 0, __ATOMIC_RELEASE);
+    return 0;
+}
+
+
+/*
+ *  Start a traversal, skipping any registers used for arguments.
+ *
+ *  Note: The traversal is a reader of the shared tables, so that
+ *  any mapping or symbol it holds remains valid until it ends.
+ */
+static void begin_traversal(traversal_t *t, void **regs, int nregs, int nargs)
+{
+    mapping_t *stack = NULL;
+    string_t owner = 0;
+    void **roots;
+    char name[20];
+    int i, nroots = nregs;
+
+    // Finish output from any previous traversal
+
+    cheritree_writer_flush();
+
+    load_filter();
+
+    t->epoch = cheritree_read_begin();
+    t->filters = cheritree_vec_current(&filters);
+    t->writing = 0;
+    t->batching = 0;
+    t->skipped = 0;
+    t->avoided = 0;
+    t->freed = 0;
+
+    // Emulated builds take the roots from the emulated registers
+
+    roots = cap_registers(regs, &nroots);
+    if (roots != regs) nargs = 0;
+
+    // The registers of another process are held in the roots
+
+    if (cheritree_is_remote()) {
+        if (nroots > 30) owner = getownerstr(cheritree_resolve_mapping(
+            cap_address_get(cap_load(&roots[30]))));
+    }
+
+    else if (nregs > 30) {
+        addr_t lr = cap_address_get(cap_load(&regs[30]));
+
+        init_stack(lr, regs);
+        owner = getownerstr(cheritree_resolve_mapping(lr));
+    }
+
+    t->owner = owner;
+
+    cheritree_map_init(&t->map, 1024);
+    cheritree_map_init(&t->exclude, 100);
+    cheritree_vec_init(&t->roots, sizeof(root_t), 64);
+    cheritree_vec_init(&t->outputs, sizeof(output_t), 1024);
+
+    // Exclude the saved registers and the stub's frame, the scanner
+    // stacks, including those used by other threads, and the cheritree
+    // frames below the stub if it didn't switch to a scanner stack
+
+    if (!cheritree_is_remote()) {
+        stack = cheritree_resolve_mapping((addr_t)regs);
+
+        if (cheritree_stack_end((addr_t)&stack) || !stack)
+            cheritree_map_add(&t->exclude, (addr_t)regs, get_stub_end(regs, nregs));
+
+        else cheritree_map_add(&t->exclude, stack->start, get_stub_end(regs, nregs));
+
+        cheritree_stack_exclude(&t->exclude);
+    }
+
+    t->tracking = (options & CHERITREE_OPT_INCREMENTAL) && begin_tracking();
+
+    // The stack pointer of another process is held in place of the DDC
+
+    if ((options & CHERITREE_OPT_FRAMES) && stack && nregs > 32)
+        add_frame_roots(t, regs, owner, stack);
+
+    else if (!cheritree_is_remote())
+        add_root(t, cap_pointer(regs), owner, "csp");
+
+    for (i = nargs; i < nroots && i < 32; i++) {
+        get_register_name(i, name);
+        add_root(t, cap_load(&roots[i]), owner, name);
+    }
+
+    if ((options & CHERITREE_OPT_ALL_THREADS) && !cheritree_is_remote())
+        add_thread_roots(t);
+
+    // The roots are held in the heap, so exclude them from the scan
+
+    if (!cheritree_is_remote() && t->roots.addr)
+        cheritree_map_add(&t->exclude, (addr_t)t->roots.addr,
+            (addr_t)(t->roots.addr + t->roots.maxcount * t->roots.size));
+}
+
+
+static void end_traversal(traversal_t *t)
+{
+    cheritree_map_delete(&t->map);
+    cheritree_map_delete(&t->exclude);
+    cheritree_vec_delete(&t->roots);
+    cheritree_vec_delete(&t->outputs);
+
+    if (t->tracking)
+        __atomic_store_n(&paging, 0, __ATOMIC_RELEASE);
+
+    cheritree_read_end(t->epoch);
+}
+
+
+/*
+ *  Wait for the output of any child started by fork_traversal().
+ */
+static void wait_child()
+{
+    pid_t pid = __atomic_exchange_n(&child, 0, __ATOMIC_ACQ_REL);
+
+    if (pid > 0) waitpid(pid, NULL, 0);
+}
+
+
+/*
+ *  Fork a child to traverse a copy-on-write image of the address
+ *  space, so the caller only pauses for the fork. Returns non-zero
+ *  in the parent, zero in the child, or -1 to traverse in the
+ *  calling process.
+ *
+ *  Note: Only one child runs at a time, so a later traversal first
+ *  waits for the previous output, as does cheritree_flush(). Only the
+ *  calling thread runs in the child, so the child doesn't track pages,
+ *  and the other threads are captured before the fork. The cheritree
+ *  locks are taken across the fork, in the order they can be nested,
+ *  so that the child can't inherit a lock held by another thread.
+ */
+static void lock_tables()
+{
+    cheritree_thread_lock();
+    cheritree_mapping_lock();
+    cheritree_symbol_lock();
+    cheritree_util_lock();
+}
+
+
+static void unlock_tables()
+{
+    cheritree_util_unlock();
+    cheritree_symbol_unlock();
+    cheritree_mapping_unlock();
+    cheritree_thread_unlock();
+}
+
+
+static void register_fork()
+{
+    pthread_atfork(lock_tables, unlock_tables, unlock_tables);
+}
+
+
+static pid_t fork_traversal()
+{
+    static pthread_once_t once = PTHREAD_ONCE_INIT;
+    pid_t pid;
+
+    if (!(options & CHERITREE_OPT_FORK)) return -1;
+
+    pthread_once(&once, register_fork);
+
+    wait_child();
+    cheritree_writer_flush();
+    fflush(stdout);
+
+    if ((options & CHERITREE_OPT_ALL_THREADS) && !cheritree_is_remote()) {
+        cheritree_vec_init(&forked, sizeof(thread_t), 16);
+        cheritree_capture_threads(&forked);
+    }
+
+    if ((pid = fork()) == 0) {
+        options &= ~CHERITREE_OPT_INCREMENTAL;
+        return 0;
+    }
+
+    release_threads(&forked);
+    if (pid < 0) return -1;
+
+    if ((pid = __atomic_exchange_n(&child, pid, __ATOMIC_ACQ_REL)) > 0)
+        waitpid(pid, NULL, 0);
+
+    return 1;
+}
+
+
+/*
+ *  End the child started by fork_traversal(), once its output is written.
+ */
+static void exit_traversal(pid_t pid)
+{
+    if (pid != 0) return;
+
+    cheritree_writer_flush();
+    fflush(stdout);
+    _exit(0);
+}
+
+
+/*
+ *  Visit each capability in the tree, without printing.
+ *
+ *  Note: The origin is NULL for a root. Every location holding a
+ *  capability is visited, unless it is hidden or pruned by the
+ *  filter, but each range is only scanned once.
+ */
+typedef void (*edge_fn)(void *ctx, root_t *root, void **origin, void *vaddr);
+
+
+static void visit_tree(traversal_t *t, root_t *root,
+    void *vaddr, edge_fn edge, void *ctx)
+{
+    void **ptr, *p;
+    scan_t scan;
+
+    if (scan_init(&scan, t, vaddr))
+        while (scan_next(&scan, &ptr, &p)) {
+            int filter = cheritree_filter_test(t->filters, p);
+
+            if (filter & CT_FILTER_PRUNE) continue;
+            if (!(filter & CT_FILTER_HIDE)) edge(ctx, root, ptr, p);
+
+            if (!is_printed(&t->map, p))
+                visit_tree(t, root, p, edge, ctx);
+        }
+}
+
+
+static void visit_edges(traversal_t *t, edge_fn edge, void *ctx)
+{
+    int i;
+
+    for (i = 0; i < getcount(&t->roots); i++) {
+        root_t *root = getroot(&t->roots, i);
+        int filter = cheritree_filter_test(t->filters, root->vaddr);
+
+        if (filter & CT_FILTER_PRUNE) continue;
+        if (!(filter & CT_FILTER_HIDE)) edge(ctx, root, NULL, root->vaddr);
+
+        if (!is_printed(&t->map, root->vaddr))
+            visit_tree(t, root, root->vaddr, edge, ctx);
+    }
+}
+
+
+void _cheritree_print_capabilities(void **regs, int nregs)
+{
+    pid_t pid = fork_traversal();
+    traversal_t t;
+
+    if (pid > 0) return;
+
+    begin_traversal(&t, regs, nregs, 0);
+
+    t.batching = (options & CHERITREE_OPT_BATCH) != 0;
+    t.writing = !t.batching && (options & CHERITREE_OPT_WRITER) &&
+        cheritree_writer_start(sizeof(record_t), 4096, write_record);
+
+    walk_roots(&t, print_visitor, &t);
+
+    if (t.writing) {
+        record_t record;
+
+        memset(&record, 0, sizeof(record));
+        record.skipped = t.skipped;
+        record.avoided = t.avoided;
+        record.freed = t.freed;
+        cheritree_writer_push(&record);
+        cheritree_writer_finish();
+    }
+
+    else {
+        if (t.batching) print_outputs(&t.outputs);
+        print_skipped(t.skipped, t.avoided, t.freed);
+    }
+
+    end_traversal(&t);
+    exit_traversal(pid);
+}
+
+
+void cheritree_flush()
+{
+    wait_child();
+    cheritree_writer_flush();
+}
+
+
+/*
+ *  Walk the tree with a visitor supplied by the caller.
+ *
+ *  Note: The visitor and its context are held in c0 and c1. The
+ *  mapping is identified by its start address, as listed by
+ *  cheritree_print_mappings(), or zero if it isn't loaded.
+ */
+typedef struct walker {
+    cheritree_visitor_t visitor;    // Caller's visitor
+    void *ctx;                      // Caller's context
+} walker_t;
+
+
+static int walk_visitor(void *ctx, const char *name,
+    void **origin, void *vaddr, int depth)
+{
+    walker_t *w = (walker_t *)ctx;
+    mapping_t *mapping = cheritree_find_mapping(cap_address_get(vaddr));
+
+    return w->visitor(w->ctx, name, origin, vaddr, depth,
+        (mapping) ? (size_t)mapping->start : 0);
+}
+
+
+void _cheritree_walk(void **regs, int nregs)
+{
+    traversal_t t;
+    walker_t w;
+
+    w.visitor = (cheritree_visitor_t)regs[0];
+    w.ctx = regs[1];
+
+    begin_traversal(&t, regs, nregs, 2);
+    walk_roots(&t, walk_visitor, &w);
+    end_traversal(&t);
+}
+
+
+/*
+ *  Search for the shortest path to a target.
+ *
+ *  Note: The search is breadth first, with each node holding the
+ *  index of its parent so that the path can be recovered once the
+ *  target is found. Nodes hold capabilities, since they are needed
+ *  to scan the next level, but are discarded after the search. The
+ *  storage of the nodes is excluded, since it is in the heap being
+ *  searched, and the exclusion follows it as it is reallocated.
+ */
+typedef struct node {
+    void *vaddr;            // Capability
+    void **origin;          // Location of capability
+    int parent;             // Parent node (index)
+    int root;               // Root (index)
+} node_t;
+
+#define getnode(v,i)        (node_t *)cheritree_vec_get((v),(i))
+
+
+static int is_covering(void *vaddr, addr_t start, addr_t end)
+{
+    addr_t base = cap_base_get(vaddr);
+
+    return base <= start && end <= base + cap_length_get(vaddr);
+}
+
+
+static int add_node(vec_t *nodes, void *vaddr,
+    void **origin, int parent, int root)
+{
+    node_t *node = (node_t *)cheritree_vec_alloc(nodes, 1);
+
+    node->vaddr = vaddr;
+    node->origin = origin;
+    node->parent = parent;
+    node->root = root;
+    return getcount(nodes) - 1;
+}
+
+
+/*
+ *  Exclude the storage of the nodes, returning non-zero if it moved.
+ */
+static int exclude_nodes(traversal_t *t, vec_t *nodes, range_t *prange)
+{
+    addr_t start = (addr_t)nodes->addr;
+    addr_t end = start + nodes->maxcount * nodes->size;
+
+    if (start == prange->start && end == prange->end) return 0;
+
+    cheritree_map_remove(&t->exclude, prange->start, prange->end);
+    if (start < end) cheritree_map_add(&t->exclude, start, end);
+
+    prange->start = start;
+    prange->end = end;
+    return 1;
+}
+
+
+static int find_path(traversal_t *t, vec_t *nodes, addr_t start, addr_t end)
+{
+    range_t storage = { 0, 0 };
+    void **ptr, *p;
+    scan_t scan;
+    int i;
+
+    for (i = 0; i < getcount(&t->roots); i++) {
+        p = getroot(&t->roots, i)->vaddr;
+
+        if (is_covering(p, start, end)) return add_node(nodes, p, NULL, -1, i);
+        if (!is_printed(&t->map, p)) add_node(nodes, p, NULL, -1, i);
+    }
+
+    exclude_nodes(t, nodes, &storage);
+
+    for (i = 0; i < getcount(nodes); i++) {
+        node_t *node = getnode(nodes, i);
+        int root = node->root;
+
+        if (!scan_init(&scan, t, node->vaddr)) continue;
+
+        while (scan_next(&scan, &ptr, &p)) {
+            if (is_covering(p, start, end))
+                return add_node(nodes, p, ptr, i, root);
+
+            if (is_printed(&t->map, p)) continue;
+
+            add_node(nodes, p, ptr, i, root);
+
+            // Check the rest of the run again if the storage moved
+
+            if (exclude_nodes(t, nodes, &storage)) scan.checked = 0;
+        }
+    }
+
+    return -1;
+}
+
+
+int _cheritree_find_path(void **regs, int nregs)
+{
+    addr_t start = (addr_t)regs[0];
+    addr_t end = start + (addr_t)regs[1];
+    vec_t nodes, path;
+    traversal_t t;
+    node_t *node;
+    int i, depth;
+
+    if (end <= start) end = start + 1;
+
+    // The query arguments are held in c0 and c1
+
+    begin_traversal(&t, regs, nregs, 2);
+    cheritree_vec_init(&nodes, sizeof(node_t), 1024);
+    cheritree_vec_init(&path, sizeof(int), 32);
+
+    i = find_path(&t, &nodes, start, end);
+
+    for (; i >= 0; i = node->parent) {
+        node = getnode(&nodes, i);
+        *(int *)cheritree_vec_alloc(&path, 1) = i;
+    }
+
+    for (depth = 0; depth < getcount(&path); depth++) {
+        i = *(int *)cheritree_vec_get(&path, getcount(&path) - depth - 1);
+        node = getnode(&nodes, i);
+
+        print_address(node->vaddr, getroot(&t.roots, node->root)->name,
+            node->origin, depth);
+    }
+
+    cheritree_vec_delete(&path);
+    cheritree_vec_delete(&nodes);
+    end_traversal(&t);
+    return depth;
+}
+
+
+/*
+ *  Report capabilities that cross between owners.
+ *
+ *  Note: Each mapping is owned by its image, or by the library that
+ *  named it (e.g. a stack). Capabilities are aggregated by source and
+ *  target owner, with the count and the total length of the bounds.
+ *  Owners with the same name can be held as different strings, so
+ *  each string is mapped to the first one seen with its name, and
+ *  the leaks are hashed by that pair of strings.
+ */
+typedef struct leak {
+    string_t fromstr;       // Source owner
+    string_t tostr;         // Target owner
+    int count;              // Number of capabilities
+    addr_t length;          // Total length of bounds
+} leak_t;
+
+typedef struct owner {
+    string_t str;           // Owner string
+    string_t canonstr;      // First string with the same name
+} owner_t;
+
+typedef struct leaks {
+    hash_t leaks;           // Leaks by source and target owner
+    hash_t owners;          // Owners by string
+} leaks_t;
+
+#define getleak(h,i)        ((leak_t *)cheritree_vec_get(&(h)->elements,(i)))
+#define getowner(h,i)       ((owner_t *)cheritree_vec_get(&(h)->elements,(i)))
+
+
+static const char *get_owner(string_t owner)
+{
+    return (owner) ? cheritree_string_get(owner) : "[unmapped]";
+}
+
+
+/*
+ *  Find the owner of an address, where anonymous mappings without
+ *  an owner are labelled "[anon]".
+ */
+static string_t resolve_owner(addr_t addr)
+{
+    static string_t anonstr;
+    mapping_t *mapping = cheritree_resolve_mapping(addr);
+
+    if (!mapping) return 0;
+    if (getownerstr(mapping)) return getownerstr(mapping);
+
+    if (!anonstr) anonstr = cheritree_string_alloc("[anon]");
+    return anonstr;
+}
+
+
+/*
+ *  Find the first string seen with the same name as an owner. Names
+ *  are only compared the first time each string is seen.
+ */
+static string_t canon_owner(hash_t *owners, string_t str)
+{
+    owner_t *owner = (owner_t *)cheritree_hash_find(owners, &str);
+    string_t canonstr = str;
+    int i;
+
+    if (owner) return owner->canonstr;
+
+    for (i = 0; i < getcount(&owners->elements); i++) {
+        owner = getowner(owners, i);
+
+        if (owner->str == owner->canonstr &&
+                !strcmp(get_owner(owner->str), get_owner(str))) {
+            canonstr = owner->str;
+            break;
+        }
+    }
+
+    owner = (owner_t *)cheritree_hash_add(owners, &str);
+    owner->canonstr = canonstr;
+    return canonstr;
+}
+
+
+static void add_leak(void *ctx, root_t *root, void **origin, void *vaddr)
+{
+    leaks_t *leaks = (leaks_t *)ctx;
+    leak_t key, *leak;
+
+    key.tostr = canon_owner(&leaks->owners, resolve_owner(cap_address_get(vaddr)));
+    key.fromstr = canon_owner(&leaks->owners,
+        (origin) ? resolve_owner((addr_t)origin) : root->ownerstr);
+
+    if (key.fromstr == key.tostr) return;
+
+    leak = (leak_t *)cheritree_hash_add(&leaks->leaks, &key);
+    leak->count++;
+    leak->length += cap_length_get(vaddr);
+}
+
+
+void _cheritree_print_leaks(void **regs, int nregs)
+{
+    pid_t pid = fork_traversal();
+    traversal_t t;
+    leaks_t leaks;
+    int i;
+
+    if (pid > 0) return;
+
+    begin_traversal(&t, regs, nregs, 0);
+    cheritree_hash_init(&leaks.leaks, sizeof(leak_t), 2 * sizeof(string_t), 64);
+    cheritree_hash_init(&leaks.owners, sizeof(owner_t), sizeof(string_t), 64);
+    visit_edges(&t, add_leak, &leaks);
+
+    printf("Capabilities crossing owners, reachable from %s:\n",
+        get_owner(t.owner));
+
+    for (i = 0; i < getcount(&leaks.leaks.elements); i++) {
+        leak_t *leak = getleak(&leaks.leaks, i);
+
+        printf("  %s -> %s: %d (%#" PRIxADDR " bytes)\n", get_owner(leak->fromstr),
+            get_owner(leak->tostr), leak->count, leak->length);
+    }
+
+    print_skipped(t.skipped, t.avoided, t.freed);
+    cheritree_hash_delete(&leaks.owners);
+    cheritree_hash_delete(&leaks.leaks);
+    end_traversal(&t);
+    exit_traversal(pid);
+}
+
+
+/*
+ *  Summarise capabilities between mappings.
+ *
+ *  Note: Capabilities are aggregated by the mapping holding them,
+ *  the mapping they refer to, and their permissions, so the output
+ *  depends on the number of mappings rather than capabilities.
+ *  Mappings are identified by their start address, with zero used
+ *  for the roots.
+ */
+typedef struct summary {
+    addr_t from;            // Source mapping
+    addr_t to;              // Target mapping
+    addr_t perms;           // Permissions
+    long count;             // Number of capabilities
+    addr_t length;          // Total length of bounds
+} summary_t;
+
+#define getsummary(h,i)     ((summary_t *)cheritree_vec_get(&(h)->elements,(i)))
+
+
+static void add_summary(void *ctx, root_t *root, void **origin, void *vaddr)
+{
+    mapping_t *target = cheritree_resolve_mapping(cap_address_get(vaddr));
+    mapping_t *source = (origin) ?
+        cheritree_resolve_mapping((addr_t)origin) : NULL;
+    summary_t key, *summary;
+
+    (void)root;
+
+    key.from = (source) ? source->start : 0;
+    key.to = (target) ? target->start : 0;
+    key.perms = cap_perms_get(vaddr);
+
+    summary = (summary_t *)cheritree_hash_add((hash_t *)ctx, &key);
+    summary->count++;
+    summary->length += cap_length_get(vaddr);
+}
+
+
+static const char *get_summary_name(addr_t start, int isroot)
+{
+    mapping_t *mapping = (start) ? cheritree_resolve_mapping(start) : NULL;
+
+    if (!mapping) return (isroot) ? "[registers]" : "[unmapped]";
+    return (*getname(mapping)) ? getname(mapping) : "[anon]";
+}
+
+
+static void perms_to_str(addr_t perms, char *s)
+{
+    s[0] = (perms & CAP_PERM_LOAD) ? 'r' : '-';
+    s[1] = (perms & CAP_PERM_STORE) ? 'w' : '-';
+    s[2] = (perms & CAP_PERM_EXECUTE) ? 'x' : '-';
+    s[3] = (perms & CAP_PERM_LOAD_CAP) ? 'R' : '-';
+    s[4] = (perms & CAP_PERM_STORE_CAP) ? 'W' : '-';
+    s[5] = 0;
+}
+
+
+void _cheritree_print_summary(void **regs, int nregs)
+{
+    pid_t pid = fork_traversal();
+    traversal_t t;
+    hash_t summary;
+    char perms[6];
+    int i;
+
+    if (pid > 0) return;
+
+    begin_traversal(&t, regs, nregs, 0);
+    cheritree_hash_init(&summary, sizeof(summary_t), 3 * sizeof(addr_t), 256);
+    visit_edges(&t, add_summary, &summary);
+
+    printf("%10s %18s %5s  %s\n", "count", "bounds", "perms", "source -> target");
+
+    for (i = 0; i < getcount(&summary.elements); i++) {
+        summary_t *sp = getsummary(&summary, i);
+
+        perms_to_str(sp->perms, perms);
+        printf("%10ld %#18" PRIxADDR " %5s  %s(%#" PRIxADDR ") -> %s(%#" PRIxADDR ")\n",
+            sp->count, sp->length, perms, get_summary_name(sp->from, 1), sp->from,
+            get_summary_name(sp->to, 0), sp->to);
+    }
+
+    print_skipped(t.skipped, t.avoided, t.freed);
+    cheritree_hash_delete(&summary);
+    end_traversal(&t);
+    exit_traversal(pid);
+}
+
+
+/*
+ *  Snapshot requested by a signal.
+ *
+ *  Note: The handler can interrupt any code, including the allocator
+ *  and stdio, so the snapshot only uses memory reserved when it is
+ *  installed and writes its output with write(). The mappings and
+ *  symbols are loaded in advance and are only read, and capabilities
+ *  outside the loaded mappings are printed without being scanned.
+ *  The number of ranges scanned is limited, to bound the latency.
+ */
+typedef struct frame {
+    void **ptr;             // Next location
+    uintptr_t end;          // End of range
+    uintptr_t checked;      // End of checked locations
+    int depth;              // Depth in tree
+} frame_t;
+
+typedef struct snapshot {
+    range_t *ranges;        // Scanned ranges (open addressed)
+    frame_t *frames;        // Pending scans
+    char *buffer;           // Output buffer
+    int used;               // Bytes in output buffer
+    int count;              // Scanned ranges
+    int truncated;          // Capabilities not scanned
+    addr_t exclude;         // Start of excluded stack
+    addr_t excludeend;      // End of excluded stack
+    vec_t *filters;         // Filter clauses
+} snapshot_t;
+
+#define SNAPSHOT_RANGES     65536
+#define SNAPSHOT_FRAMES     1024
+#define SNAPSHOT_BUFFER     8192
+
+extern void cheritree_signal_snapshot(void *context);
+
+static snapshot_t snapshot;
+static int snapping;
+
+
+static void put_flush(snapshot_t *s)
+{
+    char *cp = s->buffer;
+    ssize_t n;
+
+    while (s->used > 0 && (n = write(STDOUT_FILENO, cp, s->used)) > 0) {
+        cp += n;
+        s->used -= n;
+    }
+
+    s->used = 0;
+}
+
+
+static void put_str(snapshot_t *s, const char *str)
+{
+    for (; *str; str++) {
+        if (s->used == SNAPSHOT_BUFFER) put_flush(s);
+        s->buffer[s->used++] = *str;
+    }
+}
+
+
+static void put_hex(snapshot_t *s, addr_t value)
+{
+    char buf[2 * sizeof(addr_t) + 3], *cp = buf + sizeof(buf) - 1;
+
+    *cp = 0;
+
+    do *--cp = "0123456789abcdef"[value & 0xf];
+    while ((value >>= 4) != 0);
+
+    *--cp = 'x';
+    *--cp = '0';
+    put_str(s, cp);
+}
+
+
+static void put_dec(snapshot_t *s, int value)
+{
+    char buf[12], *cp = buf + sizeof(buf) - 1;
+
+    *cp = 0;
+
+    do *--cp = '0' + value % 10;
+    while ((value /= 10) != 0);
+
+    put_str(s, cp);
+}
+
+
+static void put_capability(snapshot_t *s, void *vaddr)
+{
+    addr_t base = cap_base_get(vaddr);
+    char perms[6];
+
+    perms_to_str(cap_perms_get(vaddr), perms);
+    put_hex(s, cap_address_get(vaddr));
+    put_str(s, " [");
+    put_str(s, perms);
+    put_str(s, ",");
+    put_hex(s, base);
+    put_str(s, "-");
+    put_hex(s, base + cap_length_get(vaddr));
+    put_str(s, "]");
+}
+
+
+static void put_address(snapshot_t *s, void *vaddr,
+    const char *name, void **origin, int depth)
+{
+    addr_t addr = cap_address_get(vaddr);
+    mapping_t *mapping = cheritree_lookup_mapping(addr);
+    char buf[SYMBOL_NAMELEN];
+    symbol_t symbol;
+    int i;
+
+    for (i = 0; i < depth; i++) put_str(s, " ");
+
+    if (depth) {
+        put_hex(s, (addr_t)origin);
+        put_str(s, ": ");
+    }
+
+    else {
+        put_str(s, name);
+        put_str(s, " ");
+    }
+
+    put_capability(s, vaddr);
+
+    if (mapping && *getname(mapping)) {
+        addr -= getbase(mapping);
+        put_str(s, "  ");
+        put_str(s, getname(mapping));
+
+        if (*getpath(mapping) && cheritree_find_symbol(getpath(mapping),
+                getbase(mapping), addr + getbase(mapping), &symbol) &&
+                *cheritree_symbol_name(&symbol, buf, sizeof(buf))) {
+            put_str(s, "!");
+            put_str(s, buf);
+
+            if ((addr -= symbol.value) != 0) {
+                put_str(s, "+");
+                put_hex(s, addr);
+            }
+        }
+
+        else {
+            put_str(s, (*getname(mapping) == '[') ? "+" : "!");
+            put_hex(s, addr);
+        }
+    }
+
+    put_str(s, "\n");
+}
+
+
+/*
+ *  Add a range to the scanned ranges, returning zero if it has
+ *  already been scanned or there is no room to record it.
+ */
+static int add_range(snapshot_t *s, void *vaddr)
+{
+    addr_t start = cap_base_get(vaddr);
+    addr_t end = start + cap_length_get(vaddr);
+    unsigned i = (unsigned)((start ^ (end << 7)) * 2654435761u);
+
+    for (;; i++) {
+        range_t *range = &s->ranges[i % SNAPSHOT_RANGES];
+
+        if (range->start == start && range->end == end) return 0;
+        if (!range->start && !range->end) break;
+    }
+
+    if (s->count >= SNAPSHOT_RANGES * 3 / 4) {
+        s->truncated++;
+        return 0;
+    }
+
+    s->ranges[i % SNAPSHOT_RANGES].start = start;
+    s->ranges[i % SNAPSHOT_RANGES].end = end;
+    s->count++;
+    return 1;
+}
+
+
+/*
+ *  Check the locations from the next one, skipping to the end of
+ *  any that can't be read or can't hold capabilities.
+ *
+ *  Note: Unmapped locations are skipped a page at a time, since the
+ *  next mapping can't be found without changing the mappings.
+ */
+static int check_frame(snapshot_t *s, frame_t *f)
+{
+    addr_t addr = (addr_t)f->ptr, pagesize = getpagesize();
+    mapping_t *mapping = cheritree_lookup_mapping(addr);
+    addr_t end;
+
+    if (s->exclude <= addr && addr < s->excludeend)
+        end = s->excludeend;
+
+    else if (!mapping)
+        end = (addr & ~(pagesize - 1)) + pagesize;
+
+    else if (cheritree_stack_end(addr))
+        end = cheritree_stack_end(addr);
+
+    else if (!cheritree_holds_capabilities(mapping))
+        end = mapping->end;
+
+    else {
+        end = (mapping->end < f->end) ? mapping->end : f->end;
+
+        if (addr < s->exclude && s->exclude < end)
+            end = s->exclude;
+
+        if (cap_resident(f->ptr, &end)) {
+            f->checked = end;
+            return 1;
+        }
+    }
+
+    if (end > f->end) end = f->end;
+
+    f->ptr = (void **)((char *)f->ptr +
+        (cap_align_up(end, sizeof(void *)) - addr));
+    return 0;
+}
+
+
+static void push_frame(snapshot_t *s, int *pn, void *vaddr, int depth)
+{
+    frame_t *f;
+
+    if (*pn >= SNAPSHOT_FRAMES) {
+        s->truncated++;
+        return;
+    }
+
+    f = &s->frames[*pn];
+
+    if (!get_pointer_range(vaddr, &f->ptr, &f->end)) return;
+
+    f->checked = 0;
+    f->depth = depth;
+    (*pn)++;
+}
+
+
+/*
+ *  Print the tree from a root, depth first, using the reserved
+ *  frames in place of recursion.
+ */
+static void snapshot_tree(snapshot_t *s, void *vaddr, const char *name)
+{
+    int filter = cheritree_filter_test(s->filters, vaddr), n = 0;
+
+    if (!cap_is_valid(vaddr)) return;
+    if (filter & CT_FILTER_PRUNE) return;
+
+    if (!(filter & CT_FILTER_HIDE))
+        put_address(s, vaddr, name, NULL, 0);
+
+    if (add_range(s, vaddr)) push_frame(s, &n, vaddr, 1);
+
+    while (n) {
+        frame_t *f = &s->frames[n-1];
+        void **ptr;
+
+        if ((uintptr_t)f->ptr >= f->end) {
+            n--;
+            continue;
+        }
+
+        if ((uintptr_t)f->ptr >= f->checked && !check_frame(s, f))
+            continue;
+
+        ptr = f->ptr++;
+
+        vaddr = cap_load(ptr);
+
+        if (!cap_is_valid(vaddr)) continue;
+
+        filter = cheritree_filter_test(s->filters, vaddr);
+
+        if (filter & CT_FILTER_PRUNE) continue;
+
+        if (!(filter & CT_FILTER_HIDE))
+            put_address(s, vaddr, name, ptr, f->depth);
+
+        if (add_range(s, vaddr)) push_frame(s, &n, vaddr, f->depth + 1);
+    }
+}
+
+
+void _cheritree_signal_snapshot(void **regs, int nregs)
+{
+    snapshot_t *s = &snapshot;
+    mapping_t *stack;
+    void **roots;
+    int idle = 0, epoch, i, nroots = nregs;
+    char name[4];
+
+    if (!__atomic_compare_exchange_n(&snapping, &idle, 1,
+            0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+        return;
+
+    epoch = cheritree_read_begin();
+    s->filters = cheritree_vec_current(&filters);
+
+    memset(s->ranges, 0, SNAPSHOT_RANGES * sizeof(range_t));
+    s->used = 0;
+    s->count = 0;
+    s->truncated = 0;
+
+    // Exclude the saved registers and the stub's frame, and the
+    // cheritree frames below it unless running on a scanner stack
+
+    stack = cheritree_lookup_mapping((addr_t)regs);
+
+    s->exclude = (stack && !cheritree_stack_end((addr_t)&stack)) ?
+        stack->start : (addr_t)regs;
+    s->excludeend = get_stub_end(regs, nregs);
+
+    // The interrupted context is passed in c0
+
+    snapshot_tree(s, cap_bounds_set(cap_load(&regs[0]), sizeof(ucontext_t)), "context");
+    snapshot_tree(s, cap_pointer(regs), "csp");
+
+    roots = cap_registers(regs, &nroots);
+
+    for (i = (roots != regs) ? 0 : 1; i < nroots && i < 32; i++) {
+        if (i < 31) {
+            name[0] = 'c';
+            name[1] = (i < 10) ? '0' + i : '0' + i / 10;
+            name[2] = (i < 10) ? 0 : '0' + i % 10;
+            name[3] = 0;
+        }
+
+        else strcpy(name, "ddc");
+
+        snapshot_tree(s, cap_load(&roots[i]), name);
+    }
+
+    if (s->truncated) {
+        put_str(s, "Truncated after ");
+        put_dec(s, s->truncated);
+        put_str(s, " capabilities that weren't scanned\n");
+    }
+
+    put_flush(s);
+    cheritree_read_end(epoch);
+    __atomic_store_n(&snapping, 0, __ATOMIC_RELEASE);
+}
+
+
+static void snapshot_handler(int signo, siginfo_t *info, void *context)
+{
+    int saved = errno;
+
+    (void)signo;
+    (void)info;
+
+    cheritree_signal_snapshot(context);
+    errno = saved;
+}
+
+
+/*
+ *  Install a handler that prints a snapshot when a signal is
+ *  received, reserving the memory it needs, opening the page map
+ *  and loading the mappings and symbols in advance. The scanner
+ *  stacks are reserved when the library is loaded.
+ */
+int cheritree_install_signal(int signo)
+{
+    size_t size = SNAPSHOT_RANGES * sizeof(range_t) +
+        SNAPSHOT_FRAMES * sizeof(frame_t) + SNAPSHOT_BUFFER;
+    struct sigaction action;
+    char *cp;
+
+    if (!snapshot.ranges) {
+        cp = mmap(NULL, size, PROT_READ | PROT_WRITE,
+            MAP_ANON | MAP_PRIVATE, -1, 0);
+
+        if (cp == MAP_FAILED) return 0;
+
+        snapshot.ranges = (range_t *)cp;
+        snapshot.frames = (frame_t *)(cp + SNAPSHOT_RANGES * sizeof(range_t));
+        snapshot.buffer = (char *)(snapshot.frames + SNAPSHOT_FRAMES);
+    }
+
+    cheritree_page_open();
+
+    load_filter();
+    cheritree_resolve_mapping((addr_t)&cheritree_install_signal);
 
-    if (nregs > 31)
-        print_capability_tree(&map, &exclude, regs[31], "ddc", NULL, 0);
+    memset(&action, 0, sizeof(action));
+    action.sa_sigaction = snapshot_handler;
+    action.sa_flags = SA_SIGINFO | SA_RESTART | SA_ONSTACK;
+    sigemptyset(&action.sa_mask);
 
-    cheritree_map_delete(&map);
-    cheritree_map_delete(&exclude);
+    return sigaction(signo, &action, NULL) == 0;
 }
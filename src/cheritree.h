@@ -7,9 +7,41 @@
 #ifndef _CHERITREE_H_
 #define _CHERITREE_H_
 
+#include <stddef.h>
 
-extern int cheritree_print_mappings();
+/*
+ *  Options.
+ */
+#define CHERITREE_OPT_INCREMENTAL   0x0001  // Only rescan pages written since the last call (Linux)
+#define CHERITREE_OPT_ALL_THREADS   0x0002  // Include the registers and stacks of all threads
+#define CHERITREE_OPT_WRITER        0x0004  // Format and write output on a background thread
+#define CHERITREE_OPT_BATCH         0x0008  // Resolve symbols in a single pass after the traversal
+#define CHERITREE_OPT_RAW           0x0010  // Print addresses without resolving symbols
+#define CHERITREE_OPT_FRAMES        0x0020  // Only scan the live stack frames, named by function
+#define CHERITREE_OPT_FORK          0x0040  // Traverse a copy-on-write image in a child process
+
+
+/*
+ *  Visitor called for each capability by cheritree_walk(), with the
+ *  name of its root, the location holding it (NULL for a root), its
+ *  depth and the start of the mapping it refers to. Capabilities
+ *  below it are only visited if the visitor returns non-zero.
+ */
+typedef int (*cheritree_visitor_t)(void *ctx, const char *root,
+    void **slot, void *capability, int depth, size_t mapping);
+
+
+extern void cheritree_print_mappings();
 extern void cheritree_print_capabilities();
+extern int cheritree_find_path(void *target, size_t length);
+extern void cheritree_print_leaks();
+extern void cheritree_print_summary();
+extern int cheritree_set_options(int options);
+extern int cheritree_set_filter(const char *filter);
+extern int cheritree_set_stack_size(size_t size);
+extern void cheritree_flush();
+extern int cheritree_install_signal(int signo);
+extern void cheritree_walk(cheritree_visitor_t visitor, void *ctx);
 
 
 static void cheritree_init() {
@@ -0,0 +1,305 @@
+/*-
+ *  SPDX-License-Identifier: BSD-3-Clause
+ *
+ *  Copyright (c) 2023, rtegrity ltd. All rights reserved.
+ */
+
+#ifndef __CHERI_PURE_CAPABILITY__
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <inttypes.h>
+#include <string.h>
+#include <sys/mman.h>
+#include "cheritree.h"
+#include "cap.h"
+#include "mapping.h"
+#include "page.h"
+#include "util.h"
+
+
+/*
+ *  Emulated memory image.
+ *
+ *  Note: The compressed bounds hold the distance from the base to
+ *  the address, the length as a mantissa and exponent, so that large
+ *  lengths are rounded up as they would be natively, and the
+ *  permissions. Capabilities are only tagged within the image.
+ */
+static char *image;
+static size_t imagesize;
+static uint64_t *shadow;
+static uint64_t *tags;
+static void **registers;
+static int nregisters;
+static cheritree_reader_t reader;
+
+#define MANTISSA_BITS       18
+#define MANTISSA_MAX        ((1 << MANTISSA_BITS) - 1)
+
+#define getdelta(b)         ((addr_t)((b) >> 32))
+#define getexponent(b)      ((int)(((b) >> 26) & 0x3f))
+#define getmantissa(b)      ((addr_t)(((b) >> 8) & MANTISSA_MAX))
+#define getperms(b)         ((int)((b) & 0xff))
+
+
+
+void *cheritree_emulate_init(size_t size)
+{
+    size_t words;
+
+    size = (size + 4095) & ~(size_t)4095;
+    words = size / sizeof(void *);
+
+    image = mmap(NULL, size, PROT_READ | PROT_WRITE,
+        MAP_ANON | MAP_PRIVATE | MAP_NORESERVE, -1, 0);
+
+    shadow = mmap(NULL, words * sizeof(uint64_t), PROT_READ | PROT_WRITE,
+        MAP_ANON | MAP_PRIVATE | MAP_NORESERVE, -1, 0);
+
+    tags = mmap(NULL, (words + 63) / 64 * sizeof(uint64_t), PROT_READ | PROT_WRITE,
+        MAP_ANON | MAP_PRIVATE | MAP_NORESERVE, -1, 0);
+
+    if (image == MAP_FAILED || shadow == MAP_FAILED || tags == MAP_FAILED) {
+        fprintf(stderr, "CheriTree: Unable to allocate memory image");
+        exit(1);
+    }
+
+    imagesize = size;
+    return image;
+}
+
+
+static long get_index(const void *loc)
+{
+    addr_t offset = (addr_t)loc - (addr_t)image;
+
+    if (!image || (addr_t)loc < (addr_t)image || offset >= imagesize)
+        return -1;
+
+    if (offset % sizeof(void *)) return -1;
+    return offset / sizeof(void *);
+}
+
+
+static void set_cap(long i, const cap_t *cap)
+{
+    ((addr_t *)image)[i] = cap->address;
+    shadow[i] = cap->bounds;
+    tags[i / 64] |= (uint64_t)1 << (i % 64);
+}
+
+
+static void set_bounds(cap_t *cap, addr_t address,
+    addr_t base, addr_t length, int perms)
+{
+    addr_t mantissa = length;
+    int exponent = 0;
+
+    while (mantissa > MANTISSA_MAX) {
+        exponent++;
+        mantissa = (length + ((addr_t)1 << exponent) - 1) >> exponent;
+    }
+
+    cap->address = address;
+    cap->bounds = ((uint64_t)(address - base) << 32) |
+        ((uint64_t)exponent << 26) | (mantissa << 8) | (perms & 0xff);
+}
+
+
+/*
+ *  Store a capability in the image, rounding up the length if
+ *  it can't be represented. Returns zero if it can't be stored.
+ */
+int cheritree_emulate_store(void **loc, addr_t address,
+    addr_t base, addr_t length, int perms)
+{
+    long i = get_index(loc);
+    cap_t cap;
+
+    if (i < 0 || address < base || address - base > UINT32_MAX)
+        return 0;
+
+    set_bounds(&cap, address, base, length, perms);
+    set_cap(i, &cap);
+    return 1;
+}
+
+
+void cheritree_emulate_clear(void **loc)
+{
+    long i = get_index(loc);
+
+    if (i >= 0) tags[i / 64] &= ~((uint64_t)1 << (i % 64));
+}
+
+
+/*
+ *  Read the address at a location of another process.
+ *
+ *  Note: The registers are held locally, and every other location
+ *  is an address in the other process.
+ */
+static int read_address(const void *c, addr_t *paddress)
+{
+    if (registers && (void **)c >= registers &&
+            (void **)c < registers + nregisters) {
+        *paddress = *(addr_t *)c;
+        return 1;
+    }
+
+    return reader((addr_t)c, paddress, sizeof(*paddress));
+}
+
+
+/*
+ *  Get a pointer in another process as a capability.
+ *
+ *  Note: Without tags, any address within a readable mapping is
+ *  treated as a pointer. Pointers have no bounds, so the bounds are
+ *  those of the mapping (limited to the distance that the bounds
+ *  can represent), with permissions from its protection.
+ */
+static int get_remote(const void *c, cap_t *cap)
+{
+    mapping_t *mapping;
+    addr_t address, base;
+    int perms;
+
+    if (!c || !read_address(c, &address)) return 0;
+
+    mapping = cheritree_find_mapping(address);
+    if (!mapping || !(getprot(mapping) & CT_PROT_READ)) return 0;
+
+    if (!cap) return 1;
+
+    base = (address - mapping->start > UINT32_MAX) ?
+        address - UINT32_MAX : mapping->start;
+
+    perms = CAP_PERM_LOAD;
+    if (getprot(mapping) & CT_PROT_WRITE) perms |= CAP_PERM_STORE;
+    if (getprot(mapping) & CT_PROT_EXEC) perms |= CAP_PERM_EXECUTE;
+
+    if (cheritree_holds_capabilities(mapping))
+        perms |= CAP_PERM_LOAD_CAP | ((perms & CAP_PERM_STORE) ?
+            CAP_PERM_STORE_CAP : 0);
+
+    set_bounds(cap, address, base, mapping->end - base, perms);
+    return 1;
+}
+
+
+/*
+ *  Get the capability at a location, returning zero if the
+ *  location isn't tagged.
+ */
+int cheritree_emulate_get(const void *c, cap_t *cap)
+{
+    long i;
+
+    if (reader) return get_remote(c, cap);
+
+    i = get_index(c);
+
+    if (i < 0 || !(tags[i / 64] & ((uint64_t)1 << (i % 64))))
+        return 0;
+
+    if (cap) {
+        cap->address = ((addr_t *)image)[i];
+        cap->bounds = shadow[i];
+    }
+
+    return 1;
+}
+
+
+addr_t cheritree_emulate_address(const void *c)
+{
+    addr_t address;
+
+    if (!c) return 0;
+    if (!reader) return *(addr_t *)c;
+
+    return (read_address(c, &address)) ? address : 0;
+}
+
+
+addr_t cheritree_emulate_base(const void *c)
+{
+    cap_t cap;
+
+    if (!cheritree_emulate_get(c, &cap)) return 0;
+    return cap.address - getdelta(cap.bounds);
+}
+
+
+addr_t cheritree_emulate_length(const void *c)
+{
+    cap_t cap;
+
+    if (!cheritree_emulate_get(c, &cap)) return 0;
+    return getmantissa(cap.bounds) << getexponent(cap.bounds);
+}
+
+
+int cheritree_emulate_perms(const void *c)
+{
+    cap_t cap;
+
+    if (!cheritree_emulate_get(c, &cap)) return 0;
+    return getperms(cap.bounds);
+}
+
+
+/*
+ *  Check residency, treating the whole image as resident so that
+ *  a scan of it isn't split at pages that were never written.
+ */
+int cheritree_emulate_resident(void *ptr, addr_t *pend)
+{
+    addr_t end = (addr_t)image + imagesize;
+
+    if (reader || get_index(ptr) < 0)
+        return cheritree_page_resident(ptr, pend);
+
+    if (*pend > end) *pend = end;
+    return 1;
+}
+
+
+/*
+ *  Set the emulated registers, which are used as roots in place
+ *  of the registers saved by the stubs.
+ */
+void cheritree_emulate_registers(void **regs, int nregs)
+{
+    registers = regs;
+    nregisters = nregs;
+}
+
+
+/*
+ *  Read the memory of another process through a reader, in place
+ *  of the image.
+ */
+void cheritree_emulate_remote(cheritree_reader_t read)
+{
+    reader = read;
+}
+
+
+/*
+ *  Return the registers to use as roots.
+ *
+ *  Note: The registers saved by the stubs hold native pointers, so
+ *  they are only used if no emulated registers have been set.
+ */
+void **cheritree_emulate_substitute(void **regs, int *nregs)
+{
+    if (!registers) return regs;
+
+    *nregs = nregisters;
+    return registers;
+}
+
+#endif /* __CHERI_PURE_CAPABILITY__ */
@@ -0,0 +1,183 @@
+/*-
+ *  SPDX-License-Identifier: BSD-3-Clause
+ *
+ *  Copyright (c) 2023, rtegrity ltd. All rights reserved.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <inttypes.h>
+#include <string.h>
+#include "cap.h"
+#include "filter.h"
+#include "util.h"
+
+
+static addr_t get_perm(char c)
+{
+    switch (c) {
+        case 'r':   return CAP_PERM_LOAD;
+        case 'w':   return CAP_PERM_STORE;
+        case 'x':   return CAP_PERM_EXECUTE;
+        case 'R':   return CAP_PERM_LOAD_CAP;
+        case 'W':   return CAP_PERM_STORE_CAP;
+    }
+
+    return 0;
+}
+
+
+static int parse_size(const char *s, size_t len, addr_t *psize)
+{
+    char buf[32], *cp;
+    addr_t size;
+
+    if (!len || len >= sizeof(buf)) return 0;
+
+    memcpy(buf, s, len);
+    buf[len] = 0;
+    size = strtoull(buf, &cp, 0);
+
+    switch (*cp) {
+        case 'k': case 'K':     size <<= 10; cp++; break;
+        case 'm': case 'M':     size <<= 20; cp++; break;
+        case 'g': case 'G':     size <<= 30; cp++; break;
+    }
+
+    *psize = size;
+    return (cp != buf && !*cp);
+}
+
+
+/*
+ *  Parse a term, e.g. "rw", "!x", "sealed" or "size>=4k".
+ */
+static int parse_term(const char *s, size_t len, filter_t *filter)
+{
+    int negate = (len && s[0] == '!');
+    addr_t perm, size;
+    size_t i;
+
+    if (negate) {
+        s++;
+        len--;
+    }
+
+    if (len == 6 && !strncmp(s, "sealed", len)) {
+        filter->sealed = !negate;
+        return 1;
+    }
+
+    if (len > 4 && !strncmp(s, "size", 4) && !negate) {
+        int equal = (len > 5 && s[5] == '=');
+
+        if (!parse_size(s + 5 + equal, len - 5 - equal, &size)) return 0;
+
+        if (s[4] == '>') filter->minsize = size + !equal;
+        else if (s[4] == '<' && (size || equal)) filter->maxsize = size - !equal;
+        else return 0;
+
+        return 1;
+    }
+
+    for (i = 0; i < len; i++) {
+        if ((perm = get_perm(s[i])) == 0) return 0;
+
+        if (negate) filter->noperms |= perm;
+        else filter->perms |= perm;
+    }
+
+    return (len != 0);
+}
+
+
+/*
+ *  Parse a clause, e.g. "prune:!R,size<64", with an optional
+ *  action and comma separated terms that must all match.
+ */
+static int parse_clause(const char *s, size_t len, filter_t *filter)
+{
+    const char *end = s + len, *cp;
+
+    filter->action = CT_FILTER_SHOW;
+    filter->sealed = -1;
+    filter->maxsize = ~(addr_t)0;
+
+    if ((cp = memchr(s, ':', len)) != NULL) {
+        if (cp - s == 4 && !strncmp(s, "show", 4)) filter->action = CT_FILTER_SHOW;
+        else if (cp - s == 4 && !strncmp(s, "hide", 4)) filter->action = CT_FILTER_HIDE;
+        else if (cp - s == 5 && !strncmp(s, "prune", 5)) filter->action = CT_FILTER_PRUNE;
+        else return 0;
+
+        s = cp + 1;
+    }
+
+    for (; s <= end; s = cp + 1) {
+        if ((cp = memchr(s, ',', end - s)) == NULL) cp = end;
+        if (!parse_term(s, cp - s, filter)) return 0;
+    }
+
+    return 1;
+}
+
+
+/*
+ *  Compile a filter expression, with clauses separated by spaces
+ *  or semicolons. Returns zero if the expression is invalid.
+ */
+int cheritree_filter_compile(const char *expr, vec_t *v)
+{
+    const char *s = expr;
+    size_t len;
+
+    for (;;) {
+        s += strspn(s, " \t;");
+        if (!*s) return 1;
+
+        len = strcspn(s, " \t;");
+
+        if (!parse_clause(s, len, (filter_t *)cheritree_vec_alloc(v, 1)))
+            return 0;
+
+        s += len;
+    }
+}
+
+
+static int is_match(const filter_t *filter, void *vaddr)
+{
+    addr_t perms = cap_perms_get(vaddr);
+    addr_t length = cap_length_get(vaddr);
+
+    if ((perms & filter->perms) != filter->perms) return 0;
+    if (perms & filter->noperms) return 0;
+    if (filter->sealed >= 0 && filter->sealed != (cap_is_sealed(vaddr) != 0))
+        return 0;
+
+    return (filter->minsize <= length && length <= filter->maxsize);
+}
+
+
+/*
+ *  Test a capability, returning the hide and prune actions that
+ *  apply to it.
+ */
+int cheritree_filter_test(const vec_t *v, void *vaddr)
+{
+    int i, result = 0, shown = -1;
+
+    for (i = 0; v && i < getcount(v); i++) {
+        const filter_t *filter = getfilter(v, i);
+        int match = is_match(filter, vaddr);
+
+        if (filter->action == CT_FILTER_SHOW) {
+            if (shown < 0) shown = 0;
+            if (match) shown = 1;
+        }
+
+        else if (match) result |= filter->action;
+    }
+
+    if (!shown) result |= CT_FILTER_HIDE;
+    return result;
+}
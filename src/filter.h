@@ -0,0 +1,50 @@
+/*-
+ *  SPDX-License-Identifier: BSD-3-Clause
+ *
+ *  Copyright (c) 2023, rtegrity ltd. All rights reserved.
+ */
+
+#ifndef _CHERITREE_FILTER_H_
+#define _CHERITREE_FILTER_H_
+
+#include <stdint.h>
+#include "util.h"
+
+
+/*
+ *  Capability filter.
+ *
+ *  Note: A filter expression is compiled into a table of clauses,
+ *  each of which matches capabilities with the given permissions,
+ *  sealing and length of bounds. A capability is hidden unless it
+ *  matches one of the show clauses (if there are any). Hidden
+ *  capabilities are still scanned, but pruned ones are not.
+ */
+typedef struct filter {
+    int action;             // Action
+    addr_t perms;           // Permissions required
+    addr_t noperms;         // Permissions excluded
+    int sealed;             // Sealed (1), unsealed (0) or either (-1)
+    addr_t minsize;         // Minimum length of bounds
+    addr_t maxsize;         // Maximum length of bounds
+} filter_t;
+
+int cheritree_filter_compile(const char *expr, vec_t *v);
+int cheritree_filter_test(const vec_t *v, void *vaddr);
+
+
+/*
+ *  Filter action.
+ */
+#define CT_FILTER_SHOW          0
+#define CT_FILTER_HIDE          1
+#define CT_FILTER_PRUNE         2
+
+
+/*
+ *  Access functions.
+ */
+#define getfilter(v,i)      ((filter_t *)cheritree_vec_get((v),(i)))
+
+
+#endif /* _CHERITREE_FILTER_H_ */
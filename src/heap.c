@@ -0,0 +1,598 @@
+/*-
+ *  SPDX-License-Identifier: BSD-3-Clause
+ *
+ *  Copyright (c) 2023, rtegrity ltd. All rights reserved.
+ */
+
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <dlfcn.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include "heap.h"
+
+
+/*
+ *  Allocator shim.
+ *
+ *  Note: The tables are held in anonymous mappings rather than on
+ *  the heap, so that recording an allocation never allocates. The
+ *  tables use open addressing, and the page counts are kept once a
+ *  page has been allocated from, so a count of zero identifies a
+ *  page that only holds freed memory. Large allocations are held as
+ *  a sorted array of ranges instead of counting each of their pages,
+ *  and a page within one is live even if its count is zero. A table
+ *  is rehashed at the same size when most used slots are tombstones.
+ *  Each table is split into shards by hash, each with its own lock,
+ *  so threads allocating concurrently rarely wait for each other.
+ *  The locks are atomic rather than mutexes, since a mutex may
+ *  allocate when it is first used.
+ */
+#define TABLE_SHARDS        16
+#define TABLE_SIZE          (4 * 1024)
+#define LARGE_PAGES         16
+#define LARGE_SIZE          1024
+#define TOMBSTONE           ((addr_t)1)
+
+typedef struct table {
+    heap_object_t *slots;   // Slots (start is key)
+    int size;               // Number of slots (power of 2)
+    int used;               // Slots in use, including tombstones
+    int count;              // Live slots
+    int lock;               // Held while the shard is used
+} table_t;
+
+typedef struct ranges {
+    heap_object_t *ranges;  // Large allocations (sorted)
+    int count;              // Ranges in use
+    int size;               // Ranges allocated
+    int lock;               // Held while the ranges are used
+} ranges_t;
+
+static table_t objects[TABLE_SHARDS], pages[TABLE_SHARDS];
+static ranges_t large;
+static addr_t pagesize;
+
+static void *(*real_malloc)(size_t);
+static void (*real_free)(void *);
+static void *(*real_calloc)(size_t, size_t);
+static void *(*real_realloc)(void *, size_t);
+static int (*real_posix_memalign)(void **, size_t, size_t);
+static void *(*real_aligned_alloc)(size_t, size_t);
+static void *(*real_memalign)(size_t, size_t);
+static void *(*real_valloc)(size_t);
+
+static char bootstrap[4096];
+static size_t bootstrapped;
+
+
+/*
+ *  Take a lock, yielding while another thread holds it, since
+ *  it may have been preempted while holding it.
+ */
+static void lock(int *plock)
+{
+    while (__atomic_exchange_n(plock, 1, __ATOMIC_ACQUIRE))
+        while (__atomic_load_n(plock, __ATOMIC_RELAXED))
+            sched_yield();
+}
+
+
+static void unlock(int *plock)
+{
+    __atomic_store_n(plock, 0, __ATOMIC_RELEASE);
+}
+
+
+/*
+ *  Take every lock, in the order they nest: the object shards, then
+ *  the page shards, then the large allocations.
+ */
+static void lock_tables()
+{
+    int i;
+
+    for (i = 0; i < TABLE_SHARDS; i++)
+        lock(&objects[i].lock);
+
+    for (i = 0; i < TABLE_SHARDS; i++)
+        lock(&pages[i].lock);
+
+    lock(&large.lock);
+}
+
+
+static void unlock_tables()
+{
+    int i;
+
+    unlock(&large.lock);
+
+    for (i = 0; i < TABLE_SHARDS; i++)
+        unlock(&pages[i].lock);
+
+    for (i = 0; i < TABLE_SHARDS; i++)
+        unlock(&objects[i].lock);
+}
+
+
+/*
+ *  Hash an address, taking the top half of the product so that
+ *  the bottom bits are mixed even for page addresses.
+ */
+static unsigned hash_addr(addr_t addr)
+{
+    return (unsigned)(((uint64_t)(addr >> 4) * 0x9e3779b97f4a7c15ULL) >> 32);
+}
+
+
+/*
+ *  Find the shard holding a key, locking it. The shard is chosen
+ *  from the top bits of the hash, since the slot is chosen from
+ *  the bottom bits.
+ */
+static table_t *lock_shard(table_t *tables, addr_t key)
+{
+    table_t *t = &tables[hash_addr(key) >> 28];
+
+    lock(&t->lock);
+    return t;
+}
+
+
+static heap_object_t *find_slot(table_t *t, addr_t key, int add)
+{
+    heap_object_t *tomb = NULL;
+    unsigned i;
+
+    if (!t->slots) return NULL;
+
+    for (i = hash_addr(key) & (t->size - 1);; i = (i + 1) & (t->size - 1)) {
+        heap_object_t *slot = &t->slots[i];
+
+        if (slot->start == key) return slot;
+        if (slot->start == TOMBSTONE && !tomb) tomb = slot;
+        if (slot->start) continue;
+
+        if (!add) return NULL;
+        if (tomb) return tomb;
+
+        t->used++;
+        return slot;
+    }
+}
+
+
+/*
+ *  Grow a table, or rehash it at the same size to clear the
+ *  tombstones if fewer than a quarter of its slots are live.
+ */
+static int grow_table(table_t *t)
+{
+    int size = (!t->size) ? TABLE_SIZE :
+        (t->count * 4 < t->size) ? t->size : t->size * 2, i;
+    heap_object_t *old = t->slots, *slots;
+    int oldsize = t->size;
+
+    slots = mmap(NULL, size * sizeof(heap_object_t), PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANON, -1, 0);
+
+    if (slots == MAP_FAILED) return 0;
+
+    t->slots = slots;
+    t->size = size;
+    t->used = 0;
+
+    for (i = 0; i < oldsize; i++)
+        if (old[i].start > TOMBSTONE)
+            *find_slot(t, old[i].start, 1) = old[i];
+
+    if (old) munmap(old, oldsize * sizeof(heap_object_t));
+    return 1;
+}
+
+
+static heap_object_t *add_slot(table_t *t, addr_t key)
+{
+    heap_object_t *slot;
+
+    if ((t->used + 1) * 2 > t->size && !grow_table(t))
+        return NULL;
+
+    slot = find_slot(t, key, 1);
+
+    if (slot->start != key) {
+        slot->start = key;
+        slot->size = 0;
+        slot->site = 0;
+        t->count++;
+    }
+
+    return slot;
+}
+
+
+/*
+ *  Find the first large allocation starting after an address.
+ */
+static int find_range(addr_t addr)
+{
+    int lo = 0, hi = large.count;
+
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+
+        if (large.ranges[mid].start <= addr) lo = mid + 1;
+        else hi = mid;
+    }
+
+    return lo;
+}
+
+
+static void add_range(addr_t start, addr_t size)
+{
+    int i;
+
+    if (large.count == large.size) {
+        int n = (large.size) ? large.size * 2 : LARGE_SIZE;
+        heap_object_t *ranges = mmap(NULL, n * sizeof(heap_object_t),
+            PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON, -1, 0);
+
+        if (ranges == MAP_FAILED) return;
+
+        if (large.ranges) {
+            memcpy(ranges, large.ranges, large.count * sizeof(heap_object_t));
+            munmap(large.ranges, large.size * sizeof(heap_object_t));
+        }
+
+        large.ranges = ranges;
+        large.size = n;
+    }
+
+    i = find_range(start);
+
+    memmove(&large.ranges[i+1], &large.ranges[i],
+        (large.count - i) * sizeof(heap_object_t));
+
+    large.ranges[i].start = start;
+    large.ranges[i].size = size;
+    large.ranges[i].site = 0;
+    large.count++;
+}
+
+
+static void remove_range(addr_t start)
+{
+    int i = find_range(start) - 1;
+
+    if (i < 0 || large.ranges[i].start != start) return;
+
+    memmove(&large.ranges[i], &large.ranges[i+1],
+        (large.count - i - 1) * sizeof(heap_object_t));
+
+    large.count--;
+}
+
+
+static int is_large(addr_t addr)
+{
+    int i = find_range(addr) - 1;
+
+    return i >= 0 && addr < large.ranges[i].start + large.ranges[i].size;
+}
+
+
+static void count_page(addr_t addr, int n)
+{
+    table_t *t = lock_shard(pages, addr);
+    heap_object_t *page = add_slot(t, addr);
+
+    if (page) page->size += n;
+    unlock(&t->lock);
+}
+
+
+static void count_pages(addr_t start, addr_t size, int n)
+{
+    addr_t first = start & ~(pagesize - 1);
+    addr_t last = (start + size - 1) & ~(pagesize - 1);
+    addr_t addr;
+
+    if ((last - first) / pagesize > LARGE_PAGES) {
+        lock(&large.lock);
+
+        if (n > 0) add_range(start, size);
+        else remove_range(start);
+
+        unlock(&large.lock);
+        return;
+    }
+
+    for (addr = first; addr <= last; addr += pagesize)
+        count_page(addr, n);
+}
+
+
+static void add_object(void *ptr, size_t size, void *site)
+{
+    heap_object_t *object;
+    table_t *t;
+
+    if (!ptr) return;
+
+    t = lock_shard(objects, (addr_t)ptr);
+
+    if ((object = add_slot(t, (addr_t)ptr)) != NULL) {
+        if (object->size) count_pages(object->start, object->size, -1);
+
+        object->size = (size) ? size : 1;
+        object->site = (addr_t)site;
+        count_pages(object->start, object->size, 1);
+    }
+
+    unlock(&t->lock);
+}
+
+
+static void remove_object(void *ptr)
+{
+    heap_object_t *object;
+    table_t *t;
+
+    if (!ptr) return;
+
+    t = lock_shard(objects, (addr_t)ptr);
+
+    if ((object = find_slot(t, (addr_t)ptr, 0)) != NULL) {
+        count_pages(object->start, object->size, -1);
+        object->start = TOMBSTONE;
+        t->count--;
+    }
+
+    unlock(&t->lock);
+}
+
+
+/*
+ *  Find the live allocation starting at an address.
+ */
+int cheritree_heap_find(addr_t addr, heap_object_t *object)
+{
+    heap_object_t *slot;
+    int found = 0;
+    table_t *t;
+
+    if (addr <= TOMBSTONE) return 0;
+
+    t = lock_shard(objects, addr);
+
+    if ((slot = find_slot(t, addr, 0)) != NULL) {
+        *object = *slot;
+        found = 1;
+    }
+
+    unlock(&t->lock);
+    return found;
+}
+
+
+/*
+ *  Return the number of live allocations on a page, or -1
+ *  if the page has never been allocated from.
+ */
+int cheritree_heap_page(addr_t addr)
+{
+    heap_object_t *slot;
+    int count = -1;
+    table_t *t;
+
+    if (!pagesize) return -1;
+
+    t = lock_shard(pages, addr & ~(pagesize - 1));
+
+    if ((slot = find_slot(t, addr & ~(pagesize - 1), 0)) != NULL)
+        count = (int)slot->size;
+
+    unlock(&t->lock);
+
+    if (count == 0) {
+        lock(&large.lock);
+        if (is_large(addr)) count = 1;
+        unlock(&large.lock);
+    }
+
+    return count;
+}
+
+
+/*
+ *  Allocations made while the allocator is being found are
+ *  served from a static buffer, and are never freed.
+ */
+static int is_bootstrap(void *ptr)
+{
+    return (char *)ptr >= bootstrap && (char *)ptr < bootstrap + sizeof(bootstrap);
+}
+
+
+static void *bootstrap_alloc(size_t size)
+{
+    size_t align = sizeof(void *) * 2;
+    void *ptr;
+
+    size = (size + align - 1) & ~(align - 1);
+    if (bootstrapped + size > sizeof(bootstrap)) return NULL;
+
+    ptr = bootstrap + bootstrapped;
+    bootstrapped += size;
+    return ptr;
+}
+
+
+static int init_allocator()
+{
+    static int initialising;
+
+    if (real_malloc) return 1;
+    if (initialising) return 0;
+
+    initialising = 1;
+    pagesize = sysconf(_SC_PAGESIZE);
+
+    real_malloc = dlsym(RTLD_NEXT, "malloc");
+    real_free = dlsym(RTLD_NEXT, "free");
+    real_calloc = dlsym(RTLD_NEXT, "calloc");
+    real_realloc = dlsym(RTLD_NEXT, "realloc");
+    real_posix_memalign = dlsym(RTLD_NEXT, "posix_memalign");
+    real_aligned_alloc = dlsym(RTLD_NEXT, "aligned_alloc");
+    real_memalign = dlsym(RTLD_NEXT, "memalign");
+    real_valloc = dlsym(RTLD_NEXT, "valloc");
+
+    // Hold the lock across a fork, so the child can't inherit it held
+
+    pthread_atfork(lock_tables, unlock_tables, unlock_tables);
+
+    initialising = 0;
+    return real_malloc != NULL;
+}
+
+
+void *malloc(size_t size)
+{
+    void *ptr;
+
+    if (!init_allocator()) return bootstrap_alloc(size);
+
+    ptr = real_malloc(size);
+    add_object(ptr, size, __builtin_return_address(0));
+    return ptr;
+}
+
+
+void free(void *ptr)
+{
+    if (!ptr || is_bootstrap(ptr)) return;
+    if (!init_allocator()) return;
+
+    remove_object(ptr);
+    real_free(ptr);
+}
+
+
+void *calloc(size_t n, size_t size)
+{
+    void *ptr;
+
+    if (!init_allocator()) return bootstrap_alloc(n * size);
+
+    ptr = real_calloc(n, size);
+    add_object(ptr, n * size, __builtin_return_address(0));
+    return ptr;
+}
+
+
+static void *realloc_object(void *ptr, size_t size, void *site)
+{
+    heap_object_t object;
+    void *newptr;
+    int found;
+
+    if (is_bootstrap(ptr)) {
+        size_t len = bootstrap + sizeof(bootstrap) - (char *)ptr;
+
+        if ((newptr = malloc(size)) != NULL)
+            memcpy(newptr, ptr, (len < size) ? len : size);
+
+        return newptr;
+    }
+
+    if (!init_allocator()) return NULL;
+
+    // Remove the allocation first, since it may be reused once freed
+
+    found = ptr && cheritree_heap_find((addr_t)ptr, &object);
+    remove_object(ptr);
+
+    if ((newptr = real_realloc(ptr, size)) != NULL)
+        add_object(newptr, size, site);
+
+    else if (found && size)
+        add_object(ptr, object.size, (void *)object.site);
+
+    return newptr;
+}
+
+
+void *realloc(void *ptr, size_t size)
+{
+    return realloc_object(ptr, size, __builtin_return_address(0));
+}
+
+
+void *reallocarray(void *ptr, size_t n, size_t size)
+{
+    if (size && n > SIZE_MAX / size) {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    return realloc_object(ptr, n * size, __builtin_return_address(0));
+}
+
+
+int posix_memalign(void **pptr, size_t align, size_t size)
+{
+    int rc;
+
+    if (!init_allocator()) return ENOMEM;
+
+    if ((rc = real_posix_memalign(pptr, align, size)) == 0)
+        add_object(*pptr, size, __builtin_return_address(0));
+
+    return rc;
+}
+
+
+void *aligned_alloc(size_t align, size_t size)
+{
+    void *ptr;
+
+    if (!init_allocator()) return NULL;
+
+    ptr = real_aligned_alloc(align, size);
+    add_object(ptr, size, __builtin_return_address(0));
+    return ptr;
+}
+
+
+void *memalign(size_t align, size_t size)
+{
+    void *ptr;
+
+    if (!init_allocator() || !real_memalign) return NULL;
+
+    ptr = real_memalign(align, size);
+    add_object(ptr, size, __builtin_return_address(0));
+    return ptr;
+}
+
+
+void *valloc(size_t size)
+{
+    void *ptr;
+
+    if (!init_allocator() || !real_valloc) return NULL;
+
+    ptr = real_valloc(size);
+    add_object(ptr, size, __builtin_return_address(0));
+    return ptr;
+}
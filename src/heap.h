@@ -0,0 +1,32 @@
+/*-
+ *  SPDX-License-Identifier: BSD-3-Clause
+ *
+ *  Copyright (c) 2023, rtegrity ltd. All rights reserved.
+ */
+
+#ifndef _CHERITREE_HEAP_H_
+#define _CHERITREE_HEAP_H_
+
+#include <stddef.h>
+#include "util.h"
+
+
+/*
+ *  Heap objects, recorded by the allocator shim (cheritreeheap.so).
+ *
+ *  Note: The shim is loaded with LD_PRELOAD and records each live
+ *  allocation, together with the number of live allocations on each
+ *  page that has been allocated from. The functions are only defined
+ *  when the shim is loaded.
+ */
+typedef struct heap_object {
+    addr_t start;           // Start address
+    addr_t size;            // Requested size
+    addr_t site;            // Call site
+} heap_object_t;
+
+int cheritree_heap_find(addr_t addr, heap_object_t *object);
+int cheritree_heap_page(addr_t addr);
+
+
+#endif /* _CHERITREE_HEAP_H_ */
@@ -4,42 +4,88 @@
  *  Copyright (c) 2023, rtegrity ltd. All rights reserved.
  */
 
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <inttypes.h>
 #include <limits.h>
 #include <string.h>
+#include <link.h>
+#include <pthread.h>
+#ifdef __linux__
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#endif
+#ifdef __FreeBSD__
+#include <sys/types.h>
+#include <sys/sysctl.h>
+#include <sys/user.h>
+#endif
+#include "cap.h"
 #include "mapping.h"
 #include "symbol.h"
 #include "util.h"
 
 
-static vec_t mappings;
+#ifdef __linux__
+#define Elf_Phdr    ElfW(Phdr)
+#endif
+
+static vec_t *mappings;
+static vec_t segments;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
 
 static void load_mappings();
+static int query_mapping(addr_t addr, addr_t *pnext);
+#ifdef __linux__
+static int query_mappings(vec_t *v);
+#endif
 static void flags_to_str(int flags, char *s, size_t len);
 static int str_to_flags(char *s, size_t len);
 
 
-static mapping_t *find_mapping(addr_t addr)
+/*
+ *  Find the mapping holding an address, with a binary search for
+ *  the first mapping ending after it, since the mappings are sorted.
+ */
+static mapping_t *find_in_version(vec_t *v, addr_t addr)
 {
-    int i;
+    int low = 0, high = (v) ? getcount(v) : 0;
 
-    if (!mappings.addr) load_mappings();
+    while (low < high) {
+        int mid = low + (high - low) / 2;
 
-    for (i = 0; i < getcount(&mappings); i++) {
-        mapping_t *mp = getmapping(&mappings, i);
-        if (addr >= mp->end) continue;
-        if (addr < mp->start) break;
-        return mp;
+        if (getmapping(v, mid)->end <= addr) low = mid + 1;
+        else high = mid;
     }
 
-    return NULL;
+    if (!v || low == getcount(v) || addr < getmapping(v, low)->start)
+        return NULL;
+
+    return getmapping(v, low);
 }
 
 
-void cheritree_set_mapping_name(mapping_t *mapping,
+static mapping_t *find_mapping(addr_t addr)
+{
+    vec_t *v = cheritree_vec_current(&mappings);
+
+    if (!v) {
+        load_mappings();
+        v = cheritree_vec_current(&mappings);
+    }
+
+    return find_in_version(v, addr);
+}
+
+
+static void name_mapping(mapping_t *mapping,
     const char *owner, const char *name)
 {
     char buf[2048];
@@ -49,25 +95,62 @@ void cheritree_set_mapping_name(mapping_t *mapping,
 
     if (strchr(getname(mapping), '!')) return;
 
-    if (owner && *owner)
+    if (owner && *owner) {
         sprintf(buf, "[%s!%s]", owner, name);
+        mapping->ownerstr = cheritree_string_alloc(owner);
+    }
     
     else sprintf(buf, "[%s]", name);
     setname(mapping, buf);
 }
 
 
+/*
+ *  Name a mapping by publishing a new version of the mappings.
+ *
+ *  Note: The mapping may be from an earlier version, so the
+ *  matching mapping is found in the current version.
+ */
+void cheritree_set_mapping_name(mapping_t *mapping,
+    const char *owner, const char *name)
+{
+    mapping_t *mp;
+    vec_t *current, v;
+
+    if (!name || !*name || !mapping) return;
+
+    pthread_mutex_lock(&lock);
+    current = cheritree_vec_current(&mappings);
+    mp = find_in_version(current, mapping->start);
+
+    if (!mp || mp->end != mapping->end || *getpath(mp) ||
+            strchr(getname(mp), '!')) {
+        pthread_mutex_unlock(&lock);
+        return;
+    }
+
+    cheritree_vec_init(&v, sizeof(mapping_t), getcount(current));
+    memcpy(cheritree_vec_alloc(&v, getcount(current)),
+        current->addr, getcount(current) * sizeof(mapping_t));
+
+    name_mapping(getmapping(&v, mp - getmapping(current, 0)), owner, name);
+    cheritree_vec_publish(&mappings, &v);
+    pthread_mutex_unlock(&lock);
+}
+
+
 static void add_mapping_name(mapping_t *mapping)
 {
     addr_t start = mapping->start, end = mapping->end;
 
     // Copy any previously identified name
 
-    if (getcount(&mappings)) {
-        mapping_t *mp = find_mapping(start);
+    if (cheritree_vec_current(&mappings)) {
+        mapping_t *mp = find_in_version(cheritree_vec_current(&mappings), start);
 
         if (mp && mp->start == start && mp->end == end && !*getpath(mp)) {
             mapping->namestr = mp->namestr;
+            mapping->ownerstr = mp->ownerstr;
             return;
         }
     }
@@ -75,14 +158,87 @@ static void add_mapping_name(mapping_t *mapping)
     // Check for current stack mapping
 
     if (start <= (addr_t)&mapping && (addr_t)&mapping < end) {
-        cheritree_set_mapping_name(mapping, NULL, "stack");
+        name_mapping(mapping, NULL, "stack");
         return;
     }
 
     // Check for current heap mapping
 
     if (start <= (addr_t)mapping && (addr_t)mapping < end)
-        cheritree_set_mapping_name(mapping, NULL, "heap");
+        name_mapping(mapping, NULL, "heap");
+}
+
+
+/*
+ *  Load the segments of each image from the dynamic linker.
+ */
+static int load_segment(struct dl_phdr_info *info, size_t size, void *data)
+{
+    addr_t pagesize = getpagesize(), base = ~(addr_t)0;
+    vec_t *v = (vec_t *)data;
+    int i, first = getcount(v);
+
+    (void)size;
+
+    for (i = 0; i < info->dlpi_phnum; i++) {
+        const Elf_Phdr *phdr = &info->dlpi_phdr[i];
+        addr_t addr = (addr_t)info->dlpi_addr + phdr->p_vaddr;
+        segment_t *segment;
+
+        if (phdr->p_type != PT_LOAD) continue;
+
+        segment = (segment_t *)cheritree_vec_alloc(v, 1);
+        segment->start = addr & ~(pagesize - 1);
+        segment->end = (addr + phdr->p_memsz + pagesize - 1) & ~(pagesize - 1);
+
+        if (segment->start < base) base = segment->start;
+    }
+
+    for (i = first; i < getcount(v); i++) {
+        segment_t *segment = getsegment(v, i);
+        segment->base = base;
+    }
+
+    return 0;
+}
+
+
+static void load_segments()
+{
+    cheritree_vec_delete(&segments);
+    cheritree_vec_init(&segments, sizeof(segment_t), 64);
+
+    // Another process's images are identified by their paths
+
+    if (!cheritree_is_remote())
+        dl_iterate_phdr(load_segment, &segments);
+}
+
+
+/*
+ *  Find the base mapping for the image with a segment
+ *  containing the address.
+ */
+static mapping_t *find_segment_base(vec_t *v, addr_t addr)
+{
+    int i, j;
+
+    for (i = 0; i < getcount(&segments); i++) {
+        segment_t *segment = getsegment(&segments, i);
+
+        if (addr < segment->start || addr >= segment->end) continue;
+
+        for (j = getcount(v) - 1; j >= 0; j--) {
+            mapping_t *mp = getmapping(v, j);
+
+            if (mp->start == segment->base) return mp;
+            if (mp->start < segment->base) break;
+        }
+
+        break;
+    }
+
+    return NULL;
 }
 
 
@@ -90,7 +246,7 @@ static int add_mapping(vec_t *v, addr_t start,
     addr_t end, int flags, char *path)
 {
     mapping_t *mapping = (mapping_t *)cheritree_vec_alloc(v, 1);
-    mapping_t *base = NULL;
+    mapping_t *base;
     char *cp;
     int i;
 
@@ -98,9 +254,21 @@ static int add_mapping(vec_t *v, addr_t start,
     mapping->end = end;
     mapping->flags = flags;
 
-    // Identify base mapping
+    // Identify base mapping from the loaded segments
 
-    for (i = 0; i < getcount(v); i++) {
+    if ((base = find_segment_base(v, start)) != NULL) {
+        mapping->base = base - mapping;
+
+        if (!*path && base != mapping) {
+            mapping->namestr = base->namestr;
+            mapping->ownerstr = base->ownerstr;
+            return 1;
+        }
+    }
+
+    // Otherwise identify base mapping from the path
+
+    else for (i = 0; i < getcount(v); i++) {
         mapping_t *mp = getmapping(v, i);
 
         if (!mp->base && *getpath(mp)) base = mp;
@@ -111,13 +279,14 @@ static int add_mapping(vec_t *v, addr_t start,
         }
     }
 
-    // Mappings included in base symbols
+    // Mappings included in base sections
 
     if (!*path && getprot(mapping) != CT_PROT_NONE) {
-        if (base && cheritree_find_type(getpath(base),
-                getbase(base), start, end) != NULL) {
+        if (base && cheritree_find_section(getpath(base),
+                getbase(base), start, end)) {
             mapping->base = base - mapping;
             mapping->namestr = base->namestr;
+            mapping->ownerstr = base->ownerstr;
             return 1;
         }
     }
@@ -135,12 +304,91 @@ static int add_mapping(vec_t *v, addr_t start,
     cp = strrchr(path, '/');
     setpath(mapping, path);
     setname(mapping, cp ? cp+1 : path);
+    mapping->ownerstr = mapping->namestr;
 
     cheritree_load_symbols(path);
     return 1;
 }
 
 
+/*
+ *  Insert a single mapping by publishing a new version of the
+ *  mappings. Returns -1 if it overlaps a loaded mapping, which
+ *  requires the mappings to be reloaded.
+ *
+ *  Note: Base offsets are relative, so they are adjusted for the
+ *  mappings after the new one that refer to an earlier base.
+ */
+static int insert_mapping(addr_t start, addr_t end, int flags, char *path)
+{
+    vec_t *current = cheritree_vec_current(&mappings), v;
+    int i, j, n = (current) ? getcount(current) : 0;
+
+    for (i = 0; i < n; i++) {
+        mapping_t *mp = getmapping(current, i);
+
+        if (mp->end <= start) continue;
+        if (mp->start < end) return (mp->start == start && mp->end == end) ? 1 : -1;
+        break;
+    }
+
+    cheritree_vec_init(&v, sizeof(mapping_t), n + 1);
+
+    if (i) memcpy(cheritree_vec_alloc(&v, i), current->addr, i * sizeof(mapping_t));
+
+    load_segments();
+    add_mapping(&v, start, end, flags, path);
+
+    for (j = i; j < n; j++) {
+        mapping_t *mp = (mapping_t *)cheritree_vec_alloc(&v, 1);
+
+        *mp = *getmapping(current, j);
+        if (j + mp->base < i) mp->base--;
+    }
+
+    cheritree_vec_publish(&mappings, &v);
+    return 1;
+}
+
+
+/*
+ *  Update the mappings after a miss, reloading them if the
+ *  address can't be queried directly. Returns zero if the address
+ *  isn't mapped, with the start of the next mapping.
+ *
+ *  Note: After a reload, the next mapping is found in the reloaded
+ *  mappings, so that a scan can skip the gap rather than reloading
+ *  the mappings again for each location in it.
+ */
+static int update_mappings(addr_t addr, addr_t *pnext)
+{
+    vec_t *v;
+    int rc, i;
+
+    pthread_mutex_lock(&lock);
+    rc = query_mapping(addr, pnext);
+    pthread_mutex_unlock(&lock);
+
+    if (rc >= 0) return rc;
+
+    load_mappings();
+    v = cheritree_vec_current(&mappings);
+    *pnext = ~(addr_t)0;
+
+    for (i = 0; i < getcount(v); i++) {
+        mapping_t *mp = getmapping(v, i);
+
+        if (addr >= mp->end) continue;
+        if (addr >= mp->start) return 1;
+
+        *pnext = mp->start;
+        break;
+    }
+
+    return 0;
+}
+
+
 #ifdef __FreeBSD__
 static struct flagmap { int i; char s[7]; int f; } flagmap[] = {
     { 0, "-----", 0 }, { 0, "r", CT_PROT_READ },
@@ -194,21 +442,105 @@ static int load_mapping(char *buffer, vec_t *v)
 }
 
 
+static int kve_to_flags(const struct kinfo_vmentry *kve)
+{
+    int flags = 0;
+
+    if (kve->kve_protection & KVME_PROT_READ) flags |= CT_PROT_READ;
+    if (kve->kve_protection & KVME_PROT_WRITE) flags |= CT_PROT_WRITE;
+    if (kve->kve_protection & KVME_PROT_EXEC) flags |= CT_PROT_EXEC;
+#ifdef KVME_PROT_READ_CAP
+    if (kve->kve_protection & KVME_PROT_READ_CAP) flags |= CT_PROT_READ_CAP;
+#endif
+#ifdef KVME_PROT_WRITE_CAP
+    if (kve->kve_protection & KVME_PROT_WRITE_CAP) flags |= CT_PROT_WRITE_CAP;
+#endif
+
+    if (kve->kve_flags & KVME_FLAG_COW) flags |= CT_FLAG_COW;
+    if (kve->kve_flags & KVME_FLAG_NEEDS_COPY) flags |= CT_FLAG_NEEDS_COPY;
+    if (kve->kve_flags & KVME_FLAG_SUPER) flags |= CT_FLAG_SUPER;
+    if (kve->kve_flags & KVME_FLAG_GROWS_UP) flags |= CT_FLAG_GROWS_UP;
+    if (kve->kve_flags & KVME_FLAG_GROWS_DOWN) flags |= CT_FLAG_GROWS_DOWN;
+    if (kve->kve_flags & KVME_FLAG_USER_WIRED) flags |= CT_FLAG_USER_WIRED;
+
+    switch (kve->kve_type) {
+    case KVME_TYPE_DEFAULT:     return flags | CT_TYPE_DEFAULT;
+    case KVME_TYPE_VNODE:       return flags | CT_TYPE_VNODE;
+    case KVME_TYPE_SWAP:        return flags | CT_TYPE_SWAP;
+    case KVME_TYPE_DEVICE:      return flags | CT_TYPE_DEVICE;
+    case KVME_TYPE_PHYS:        return flags | CT_TYPE_PHYS;
+    case KVME_TYPE_DEAD:        return flags | CT_TYPE_DEAD;
+    case KVME_TYPE_SG:          return flags | CT_TYPE_SG;
+    case KVME_TYPE_MGTDEVICE:   return flags | CT_TYPE_MGTDEVICE;
+#ifdef KVME_TYPE_GUARD
+    case KVME_TYPE_GUARD:       return flags | CT_TYPE_GUARD;
+#endif
+    case KVME_TYPE_NONE:        return flags | CT_TYPE_NONE;
+    default:                    return flags | CT_TYPE_UNKNOWN;
+    }
+}
+
+
+/*
+ *  Load mappings directly from the kernel, avoiding the
+ *  need to start procstat.
+ */
+static int load_vmmap(vec_t *v)
+{
+    int mib[4] = { CTL_KERN, KERN_PROC, KERN_PROC_VMMAP, cheritree_get_target() };
+    size_t len = 0;
+    char *buf, *bp;
+
+    if (sysctl(mib, 4, NULL, &len, NULL, 0) != 0) return 0;
+
+    len = len * 4 / 3;
+    if ((buf = malloc(len)) == NULL) return 0;
+
+    if (sysctl(mib, 4, buf, &len, NULL, 0) != 0) {
+        free(buf);
+        return 0;
+    }
+
+    for (bp = buf; bp < buf + len; ) {
+        struct kinfo_vmentry *kve = (struct kinfo_vmentry *)bp;
+
+        if (kve->kve_structsize == 0) break;
+
+        add_mapping(v, kve->kve_start, kve->kve_end,
+            kve_to_flags(kve), kve->kve_path);
+        bp += kve->kve_structsize;
+    }
+
+    free(buf);
+    cheritree_vec_trim(v);
+    return (v->addr != NULL);
+}
+
+
 static void load_mappings()
 {
     char cmd[2048];
     vec_t v;
 
-    sprintf(cmd, "procstat -v %d", getpid());
+    sprintf(cmd, "procstat -v %d", cheritree_get_target());
     cheritree_vec_init(&v, sizeof(mapping_t), 1024);
 
-    if (!cheritree_load_from_cmd(cmd, load_mapping, &v)) {
+    pthread_mutex_lock(&lock);
+    load_segments();
+
+    if (!load_vmmap(&v) && !cheritree_load_from_cmd(cmd, load_mapping, &v)) {
         fprintf(stderr, "Unable to load mappings");
         exit(1);        
     }
 
-    cheritree_vec_delete(&mappings);
-    mappings = v;
+    cheritree_vec_publish(&mappings, &v);
+    pthread_mutex_unlock(&lock);
+}
+
+
+static int query_mapping(addr_t addr, addr_t *pnext)
+{
+    return -1;
 }
 #endif /* __FreeBSD__ */
 
@@ -217,7 +549,7 @@ static void load_mappings()
 static struct flagmap { int i; char s[5]; int f; } flagmap[] = {
     { 0, "----", 0 }, { 0, "r", CT_PROT_READ },
     { 1, "w", CT_PROT_WRITE }, { 2, "x", CT_PROT_EXEC },
-    { 3, "p", CT_FLAG_SHARED }, { 3, "p", CT_FLAG_PRIVATE },
+    { 3, "s", CT_FLAG_SHARED }, { 3, "p", CT_FLAG_PRIVATE },
     { 0 }
 };
 
@@ -244,45 +576,243 @@ static int load_mapping(char *buffer, vec_t *v)
     memset(s, 0, sizeof(s));
 
     if (sscanf(buffer, "%" PRIxADDR "-%" PRIxADDR
-            " %4s %*x %*d:%*d %*d %s", &start, &end, s, path) < 4)
+            " %4s %*x %*x:%*x %*d %s", &start, &end, s, path) < 3)
         return 1;
 
     return add_mapping(v, start, end, str_to_flags(s, sizeof(s)), path);
 }
 
 
+/*
+ *  Load the mappings, querying them one at a time if possible
+ *  rather than parsing the maps file.
+ */
 static void load_mappings()
 {
     char path[2048];
     vec_t v;
 
-    sprintf(path, "/proc/%d/maps", getpid());
+    sprintf(path, "/proc/%d/maps", cheritree_get_target());
     cheritree_vec_init(&v, sizeof(mapping_t), 1024);
 
-    if (!cheritree_load_from_path(path, load_mapping, &v)) {
+    pthread_mutex_lock(&lock);
+    load_segments();
+
+    if (!query_mappings(&v) &&
+            !cheritree_load_from_path(path, load_mapping, &v)) {
         fprintf(stderr, "Unable to load mappings");
         exit(1);        
     }
 
-    cheritree_vec_delete(&mappings);
-    mappings = v;
+    cheritree_vec_publish(&mappings, &v);
+    pthread_mutex_unlock(&lock);
+}
+
+
+/*
+ *  Query the mapping holding an address (Linux 6.11 or later).
+ */
+#ifndef PROCMAP_QUERY
+struct procmap_query {
+    uint64_t size;
+    uint64_t query_flags;
+    uint64_t query_addr;
+    uint64_t vma_start;
+    uint64_t vma_end;
+    uint64_t vma_flags;
+    uint64_t vma_page_size;
+    uint64_t vma_offset;
+    uint64_t inode;
+    uint32_t dev_major;
+    uint32_t dev_minor;
+    uint32_t vma_name_size;
+    uint32_t build_id_size;
+    uint64_t vma_name_addr;
+    uint64_t build_id_addr;
+};
+
+#define PROCMAP_QUERY                       _IOWR('f', 17, struct procmap_query)
+#define PROCMAP_QUERY_VMA_READABLE          0x01
+#define PROCMAP_QUERY_VMA_WRITABLE          0x02
+#define PROCMAP_QUERY_VMA_EXECUTABLE        0x04
+#define PROCMAP_QUERY_VMA_SHARED            0x08
+#define PROCMAP_QUERY_COVERING_OR_NEXT_VMA  0x10
+#endif
+
+static int mapsfd = -1;
+
+
+/*
+ *  Query the mapping holding an address, or the next mapping.
+ *  Returns 1 if there is one, 0 if there are none above the
+ *  address, or -1 if the query isn't supported.
+ */
+static int query_vma(addr_t addr, addr_t *pstart,
+    addr_t *pend, int *pflags, char *path)
+{
+    struct procmap_query q;
+    char s[5];
+
+    sprintf(path, "/proc/%d/maps", cheritree_get_target());
+
+    if (mapsfd == -1 && (mapsfd = open(path, O_RDONLY)) < 0)
+        mapsfd = -2;
+
+    if (mapsfd < 0) return -1;
+
+    memset(&q, 0, sizeof(q));
+    q.size = sizeof(q);
+    q.query_flags = PROCMAP_QUERY_COVERING_OR_NEXT_VMA;
+    q.query_addr = addr;
+    q.vma_name_addr = (uint64_t)(uintptr_t)path;
+    q.vma_name_size = PATH_MAX;
+    strcpy(path, "");
+
+    if (ioctl(mapsfd, PROCMAP_QUERY, &q) != 0) {
+        if (errno == ENOENT) return 0;
+
+        close(mapsfd);
+        mapsfd = -2;
+        return -1;
+    }
+
+    if (!q.vma_name_size) strcpy(path, "");
+
+    strcpy(s, "---p");
+    if (q.vma_flags & PROCMAP_QUERY_VMA_READABLE) s[0] = 'r';
+    if (q.vma_flags & PROCMAP_QUERY_VMA_WRITABLE) s[1] = 'w';
+    if (q.vma_flags & PROCMAP_QUERY_VMA_EXECUTABLE) s[2] = 'x';
+    if (q.vma_flags & PROCMAP_QUERY_VMA_SHARED) s[3] = 's';
+
+    *pstart = q.vma_start;
+    *pend = q.vma_end;
+    *pflags = str_to_flags(s, sizeof(s));
+    return 1;
+}
+
+
+/*
+ *  Returns 1 if the mapping has been added, 0 if the address
+ *  isn't mapped, or -1 if the query isn't supported.
+ */
+static int query_mapping(addr_t addr, addr_t *pnext)
+{
+    char path[PATH_MAX];
+    addr_t start, end;
+    int flags, rc;
+
+    if ((rc = query_vma(addr, &start, &end, &flags, path)) <= 0) {
+        *pnext = ~(addr_t)0;
+        return rc;
+    }
+
+    if (start > addr) {
+        *pnext = start;
+        return 0;
+    }
+
+    return insert_mapping(start, end, flags, path);
+}
+
+
+/*
+ *  Load all of the mappings by querying each in turn. Returns
+ *  zero if the query isn't supported.
+ *
+ *  Note: The images are identified from the segments reported by
+ *  the dynamic linker, so the mappings are added without parsing
+ *  any text.
+ */
+static int query_mappings(vec_t *v)
+{
+    char path[PATH_MAX];
+    addr_t addr = 0, start, end;
+    int flags, rc;
+
+    while ((rc = query_vma(addr, &start, &end, &flags, path)) > 0) {
+        add_mapping(v, start, end, flags, path);
+        addr = end;
+    }
+
+    if (rc < 0) cheritree_vec_delete(v);
+    return rc == 0;
 }
 #endif /* __linux__ */
 
 
+/*
+ *  Hold the mapping lock across a fork.
+ */
+void cheritree_mapping_lock()
+{
+    pthread_mutex_lock(&lock);
+}
+
+
+void cheritree_mapping_unlock()
+{
+    pthread_mutex_unlock(&lock);
+}
+
+
+/*
+ *  Find a mapping without reloading.
+ */
+mapping_t *cheritree_find_mapping(addr_t addr)
+{
+    return find_mapping(addr);
+}
+
+
+/*
+ *  Find a mapping in the loaded mappings, returning NULL if they
+ *  haven't been loaded.
+ *
+ *  Note: This doesn't allocate or read /proc, so it can be called
+ *  from a signal handler.
+ */
+mapping_t *cheritree_lookup_mapping(addr_t addr)
+{
+    return find_in_version(cheritree_vec_current(&mappings), addr);
+}
+
+
+/*
+ *  Find the mappings for a sorted array of addresses, with a single
+ *  pass through the mappings. Addresses that aren't in the loaded
+ *  mappings are left as NULL.
+ */
+void cheritree_find_mappings(const addr_t *addrs, int n, mapping_t **found)
+{
+    vec_t *v = cheritree_vec_current(&mappings);
+    int i, j = 0;
+
+    if (!v) {
+        load_mappings();
+        v = cheritree_vec_current(&mappings);
+    }
+
+    for (i = 0; i < n; i++) {
+        while (j < getcount(v) && getmapping(v, j)->end <= addrs[i]) j++;
+
+        found[i] = (j < getcount(v) && getmapping(v, j)->start <= addrs[i]) ?
+            getmapping(v, j) : NULL;
+    }
+}
+
+
 mapping_t *cheritree_resolve_mapping(addr_t addr)
 {
     mapping_t *mapping = find_mapping(addr);
+    addr_t next;
 
     if (mapping && getprot(mapping) == CT_PROT_NONE) {
         load_mappings();
         mapping = find_mapping(addr);
     }
 
-    if (!mapping) {
-        load_mappings();
+    if (!mapping && update_mappings(addr, &next))
         return find_mapping(addr);
-    }
 
     return mapping;
 }
@@ -290,38 +820,86 @@ mapping_t *cheritree_resolve_mapping(addr_t addr)
 
 void cheritree_print_mappings()
 {
+    int epoch = cheritree_read_begin();
+    vec_t *v;
     int i;
 
-    if (!mappings.addr) load_mappings();
+    if (!cheritree_vec_current(&mappings)) load_mappings();
+    v = cheritree_vec_current(&mappings);
 
-    for (i = 0; i < getcount(&mappings); i++) {
-        mapping_t *mp = getmapping(&mappings, i);
+    for (i = 0; i < getcount(v); i++) {
+        mapping_t *mp = getmapping(v, i);
 
         if (getprot(mp) != CT_PROT_NONE)
             print_mapping(mp);
     }
+
+    cheritree_read_end(epoch);
+}
+
+
+/*
+ *  Check whether a mapping can contain valid capabilities.
+ *
+ *  Note: On CheriBSD the kernel reports whether capabilities can be
+ *  loaded from each mapping. Otherwise only text and shared read-only
+ *  mappings are excluded, since private read-only file mappings can
+ *  hold relocated capabilities (e.g. the GOT after RELRO).
+ */
+int cheritree_holds_capabilities(const mapping_t *mapping)
+{
+    int flags = getflags(mapping);
+
+    if (getprot(mapping) == CT_PROT_NONE) return 0;
+
+#if defined(__FreeBSD__) && defined(__CHERI_PURE_CAPABILITY__)
+    if (!(flags & (CT_PROT_READ_CAP | CT_FLAG_HOLD_CAP))) return 0;
+#endif
+
+    if ((flags & CT_PROT_EXEC) && !(flags & CT_PROT_WRITE)) return 0;
+
+    if ((flags & CT_FLAG_SHARED) && !(flags & CT_PROT_WRITE) &&
+            *getpath(mapping))
+        return 0;
+
+    return 1;
 }
 
 
-int cheritree_dereference_address(void ***pptr, void **paddr)
+/*
+ *  Move the cursor to the mapping holding an address.
+ *
+ *  Note: The cursor covers the whole mapping, so a scan only looks
+ *  up the mappings when it crosses a boundary. If the address can't
+ *  hold capabilities, the cursor covers the range to skip, which is
+ *  the rest of the mapping or the gap before the next mapping.
+ */
+int cheritree_cursor_seek(cursor_t *cursor, addr_t addr)
 {
-    addr_t addr = (addr_t)*pptr;
     mapping_t *mapping = find_mapping(addr);
+    addr_t next;
+
+    cursor->start = addr;
+    cursor->end = addr + sizeof(void *);
+    cursor->prot = CT_PROT_NONE;
+    cursor->valid = 0;
 
     if (!mapping) {
-        load_mappings();
+        if (!update_mappings(addr, &next)) {
+            if (next > cursor->end) cursor->end = next;
+            return 0;
+        }
+
         mapping = find_mapping(addr);
     }
 
     if (!mapping) return 0;
 
-    if (getprot(mapping) == CT_PROT_NONE) {
-        *(char **)pptr += (mapping->end - sizeof(void *)) - (addr_t)*pptr;
-         return 0;
-    }
-
-    *paddr = **pptr;
-    return 1;
+    cursor->start = mapping->start;
+    cursor->end = mapping->end;
+    cursor->prot = getprot(mapping);
+    cursor->valid = cheritree_holds_capabilities(mapping);
+    return cursor->valid;
 }
 
 
@@ -22,13 +22,42 @@ typedef struct mapping {
     int base;                   // Start of image (offset)
     string_t pathstr;           // Path string
     string_t namestr;           // Name string
+    string_t ownerstr;          // Owner string
 } mapping_t;
 
+/*
+ *  Loaded segment.
+ *
+ *  Note: Segments are obtained from the dynamic linker and are
+ *  used to associate mappings with the image that loaded them.
+ */
+typedef struct segment {
+    addr_t start;               // Start address
+    addr_t end;                 // End address
+    addr_t base;                // Start of image
+} segment_t;
+
+/*
+ *  Position of a scan within the mappings.
+ */
+typedef struct cursor {
+    addr_t start;               // Start of range
+    addr_t end;                 // End of range
+    int prot;                   // Protection of mapping
+    int valid;                  // Range can hold capabilities
+} cursor_t;
+
 mapping_t *cheritree_resolve_mapping(addr_t addr);
+mapping_t *cheritree_find_mapping(addr_t addr);
+mapping_t *cheritree_lookup_mapping(addr_t addr);
+void cheritree_mapping_lock();
+void cheritree_mapping_unlock();
+void cheritree_find_mappings(const addr_t *addrs, int n, mapping_t **found);
 void cheritree_print_mappings();
 void cheritree_set_mapping_name(mapping_t *mapping,
     const char *owner, const char *name);
-int cheritree_dereference_address(void ***pptr, void **paddr);
+int cheritree_cursor_seek(cursor_t *cursor, addr_t addr);
+int cheritree_holds_capabilities(const mapping_t *mapping);
 
 
 /*
@@ -79,11 +108,13 @@ int cheritree_dereference_address(void ***pptr, void **paddr);
 /*
  *  Access functions.
  */
-#define getmapping(v,i)     (mapping_t *)cheritree_vec_get((v),(i))
+#define getmapping(v,i)     ((mapping_t *)cheritree_vec_get((v),(i)))
+#define getsegment(v,i)     ((segment_t *)cheritree_vec_get((v),(i)))
 #define getbase(m)          ((m) ? (m)[(m)->base].start : 0)
 #define gettype(m)          ((m) ? ((m)->flags & CT_TYPE_MASK) : 0)
 #define getprot(m)          ((m) ? ((m)->flags & CT_PROT_MASK) : 0)
 #define getflags(m)         ((m) ? (m)->flags : 0)
+#define getownerstr(m)      ((m) ? ((m)->ownerstr ? (m)->ownerstr : (m)->namestr) : 0)
 
 
 #endif /* _CHERITREE_MAPPING_H_ */
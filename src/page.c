@@ -0,0 +1,350 @@
+/*-
+ *  SPDX-License-Identifier: BSD-3-Clause
+ *
+ *  Copyright (c) 2023, rtegrity ltd. All rights reserved.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <string.h>
+#include <sys/mman.h>
+#include "page.h"
+#include "util.h"
+
+
+#define PM_SOFT_DIRTY       (1ULL << 55)
+#define PM_SWAPPED          (1ULL << 62)
+#define PM_PRESENT          (1ULL << 63)
+#define PM_BATCH            512
+
+#define getpage(i)          ((page_t *)cheritree_vec_get(&pages.elements,(i)))
+
+static hash_t pages;
+static addr_t pagesize;
+static int words;
+
+
+static addr_t get_pagesize()
+{
+    if (!pagesize) pagesize = sysconf(_SC_PAGESIZE);
+    return pagesize;
+}
+
+
+#ifdef __linux__
+static int supported = -1;
+static int pagemapfd = -1;
+
+
+static int read_pagemap(int fd, addr_t addr, uint64_t *entries, int n)
+{
+    off_t offset = (addr / get_pagesize()) * sizeof(uint64_t);
+    ssize_t len = n * sizeof(uint64_t);
+
+    return pread(fd, entries, len, offset) == len;
+}
+
+
+/*
+ *  Open the page map, keeping it open for later queries.
+ */
+static int open_pagemap()
+{
+    int fd = __atomic_load_n(&pagemapfd, __ATOMIC_ACQUIRE), unset = -1;
+    char path[64];
+
+    if (fd >= 0) return fd;
+
+    sprintf(path, "/proc/%d/pagemap", cheritree_get_target());
+    if ((fd = open(path, O_RDONLY)) < 0) return -1;
+
+    if (!__atomic_compare_exchange_n(&pagemapfd, &unset, fd,
+            0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        close(fd);
+        fd = unset;
+    }
+
+    return fd;
+}
+
+
+/*
+ *  Read the residency of up to n pages, where a page that has
+ *  been swapped out is still resident.
+ */
+static int read_residency(void *ptr, int n, char *resident)
+{
+    uint64_t entries[PM_BATCH];
+    addr_t addr = (addr_t)ptr;
+    int fd = open_pagemap(), i;
+
+    if (fd < 0 || !read_pagemap(fd, addr, entries, n)) return 0;
+
+    for (i = 0; i < n; i++)
+        resident[i] = (entries[i] & (PM_PRESENT | PM_SWAPPED)) != 0;
+
+    return 1;
+}
+
+
+static int clear_soft_dirty()
+{
+    int fd = open("/proc/self/clear_refs", O_WRONLY);
+    int rc = (fd >= 0 && write(fd, "4", 1) == 1);
+
+    if (fd >= 0) close(fd);
+    return rc;
+}
+
+
+/*
+ *  Check that a write is reflected in the soft-dirty bits,
+ *  since they are not supported on all architectures.
+ */
+static int check_soft_dirty(int fd)
+{
+    static volatile int probe;
+    uint64_t entry;
+
+    probe++;
+    return read_pagemap(fd, (addr_t)&probe, &entry, 1) &&
+        (entry & PM_SOFT_DIRTY);
+}
+
+
+static int compare_pages(const void *a, const void *b)
+{
+    addr_t x = ((const page_t *)a)->addr, y = ((const page_t *)b)->addr;
+
+    return (x > y) - (x < y);
+}
+
+
+/*
+ *  Drop the records for pages written since the last scan, reading
+ *  the page map in batches of consecutive pages.
+ *
+ *  Note: Pages that are no longer resident are dropped as well,
+ *  which covers those that have been unmapped, so the mappings
+ *  don't need to be reloaded. A page mapped again at the same
+ *  address is reported as soft-dirty. The rest are kept in address
+ *  order, so that the batches are longer on the next scan.
+ */
+static void discard_dirty_pages(int fd)
+{
+    int count = getcount(&pages.elements), i, j, n;
+    uint64_t entries[PM_BATCH];
+    hash_t kept;
+
+    if (!count) return;
+
+    qsort(pages.elements.addr, count, pages.elements.size, compare_pages);
+
+    cheritree_hash_init(&kept, pages.elements.size, sizeof(addr_t),
+        (count > 1024) ? count : 1024);
+
+    for (i = 0; i < count; i += n) {
+        addr_t addr = getpage(i)->addr;
+
+        for (n = 1; n < PM_BATCH && i + n < count; n++)
+            if (getpage(i+n)->addr != addr + n * pagesize) break;
+
+        if (!read_pagemap(fd, addr, entries, n))
+            memset(entries, 0xff, sizeof(entries));
+
+        for (j = 0; j < n; j++)
+            if ((entries[j] & (PM_PRESENT | PM_SWAPPED)) &&
+                    !(entries[j] & PM_SOFT_DIRTY))
+                memcpy(cheritree_hash_add(&kept, &getpage(i+j)->addr),
+                    getpage(i+j), pages.elements.size);
+    }
+
+    cheritree_hash_delete(&pages);
+    pages = kept;
+}
+
+
+static int track_pages()
+{
+    int fd;
+
+    // The soft-dirty bits can only be checked in the calling process
+
+    if (!supported || cheritree_is_remote()) return 0;
+
+    if ((fd = open_pagemap()) < 0) {
+        supported = 0;
+        return 0;
+    }
+
+    discard_dirty_pages(fd);
+
+    if (!clear_soft_dirty()) supported = 0;
+    else if (supported < 0) supported = check_soft_dirty(fd);
+
+    if (!supported) cheritree_hash_delete(&pages);
+    return supported;
+}
+#else
+/*
+ *  Note: mincore() can't distinguish pages that have been swapped
+ *  out from those that were never populated, so both are skipped.
+ */
+static int read_residency(void *ptr, int n, char *resident)
+{
+    char vec[PM_BATCH];
+    int i;
+
+    if (cheritree_is_remote()) return 0;
+    if (mincore(ptr, n * get_pagesize(), vec) != 0) return 0;
+
+    for (i = 0; i < n; i++)
+        resident[i] = (vec[i] & 1);
+
+    return 1;
+}
+
+
+static int track_pages()
+{
+    return 0;
+}
+#endif /* __linux__ */
+
+
+/*
+ *  Start a scan, returning zero if pages can't be tracked.
+ *
+ *  Note: The soft-dirty bits are cleared before the scan, so
+ *  any page written during the scan will be scanned again.
+ */
+int cheritree_page_begin()
+{
+    if (!words) {
+        words = (get_pagesize() / sizeof(void *) + 63) / 64;
+
+        cheritree_hash_init(&pages, sizeof(page_t) +
+            2 * words * sizeof(uint64_t), sizeof(addr_t), 1024);
+    }
+
+    return track_pages();
+}
+
+
+/*
+ *  Find the record for the page holding an address, adding it if
+ *  necessary. Returns its index, which remains valid for the scan.
+ */
+int cheritree_page_find(addr_t addr)
+{
+    addr_t base = addr & ~(pagesize - 1);
+    page_t *page = (page_t *)cheritree_hash_add(&pages, &base);
+
+    return ((char *)page - pages.elements.addr) / pages.elements.size;
+}
+
+
+/*
+ *  Check whether a slot is known to hold a capability.
+ *  Returns -1 if the slot needs to be scanned.
+ */
+int cheritree_page_test(int index, addr_t addr)
+{
+    page_t *page = getpage(index);
+    int slot = (addr - page->addr) / sizeof(void *);
+    uint64_t bit = 1ULL << (slot % 64);
+
+    if (!(page->bits[slot / 64] & bit)) return -1;
+    return (page->bits[words + slot / 64] & bit) != 0;
+}
+
+
+/*
+ *  Find the next slot from an address, up to the end of a run in
+ *  the page, that needs to be scanned or is known to hold a
+ *  capability. Returns the end if there is none.
+ *
+ *  Note: The slots known not to hold a capability are skipped a
+ *  word of the bitmap at a time.
+ */
+addr_t cheritree_page_next(int index, addr_t addr, addr_t end)
+{
+    page_t *page = getpage(index);
+    int slot = (addr - page->addr) / sizeof(void *);
+    int last = (end - page->addr + sizeof(void *) - 1) / sizeof(void *);
+    int i = slot / 64;
+    uint64_t mask;
+
+    if (last > words * 64) last = words * 64;
+
+    mask = (~page->bits[i] | page->bits[words + i]) & (~0ULL << (slot % 64));
+
+    while (!mask) {
+        if (++i * 64 >= last) return end;
+        mask = ~page->bits[i] | page->bits[words + i];
+    }
+
+    slot = i * 64 + __builtin_ctzll(mask);
+    return (slot < last) ? page->addr + slot * sizeof(void *) : end;
+}
+
+
+/*
+ *  Record the result of scanning a slot.
+ */
+void cheritree_page_record(int index, addr_t addr, int valid)
+{
+    page_t *page = getpage(index);
+    int slot = (addr - page->addr) / sizeof(void *);
+    uint64_t bit = 1ULL << (slot % 64);
+
+    page->bits[slot / 64] |= bit;
+
+    if (valid) page->bits[words + slot / 64] |= bit;
+    else page->bits[words + slot / 64] &= ~bit;
+}
+
+
+/*
+ *  Prepare to check residency, opening the page map in advance.
+ *  Returns zero if it can't be opened.
+ */
+int cheritree_page_open()
+{
+#ifdef __linux__
+    return open_pagemap() >= 0;
+#else
+    return 1;
+#endif
+}
+
+
+/*
+ *  Check whether the page holding an address is resident, and
+ *  reduce the end to the last page with the same residency.
+ *  Returns 1 if the residency can't be determined.
+ */
+int cheritree_page_resident(void *ptr, addr_t *pend)
+{
+    addr_t addr = (addr_t)ptr, size = get_pagesize();
+    addr_t base = addr & ~(size - 1);
+    char resident[PM_BATCH];
+    int i, n;
+
+    n = (*pend - base + size - 1) / size;
+    if (n > PM_BATCH) n = PM_BATCH;
+
+    if (n <= 0 || !read_residency((char *)ptr - (addr - base), n, resident))
+        return 1;
+
+    for (i = 1; i < n; i++)
+        if (resident[i] != resident[0]) break;
+
+    if (base + i * size < *pend)
+        *pend = base + i * size;
+
+    return resident[0];
+}
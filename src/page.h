@@ -0,0 +1,45 @@
+/*-
+ *  SPDX-License-Identifier: BSD-3-Clause
+ *
+ *  Copyright (c) 2023, rtegrity ltd. All rights reserved.
+ */
+
+#ifndef _CHERITREE_PAGE_H_
+#define _CHERITREE_PAGE_H_
+
+#include <stdint.h>
+#include "util.h"
+
+
+/*
+ *  Page tracking.
+ *
+ *  Note: Each page records which slots have been scanned and which
+ *  of them held a capability. Pages written since the last scan are
+ *  identified using the soft-dirty bits, which are only supported on
+ *  Linux, and their records are discarded. Records for pages that
+ *  are no longer resident are dropped at the start of each scan.
+ */
+typedef struct page {
+    addr_t addr;            // Page address
+    uint64_t bits[];        // Scanned slots, then capability slots
+} page_t;
+
+int cheritree_page_begin();
+int cheritree_page_find(addr_t addr);
+int cheritree_page_test(int index, addr_t addr);
+addr_t cheritree_page_next(int index, addr_t addr, addr_t end);
+void cheritree_page_record(int index, addr_t addr, int valid);
+
+
+/*
+ *  Page residency.
+ *
+ *  Note: Pages that have never been populated can't hold any
+ *  capabilities, and reading them would only fault in zero pages.
+ */
+int cheritree_page_open();
+int cheritree_page_resident(void *ptr, addr_t *pend);
+
+
+#endif /* _CHERITREE_PAGE_H_ */
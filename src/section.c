@@ -0,0 +1,165 @@
+/*-
+ *  SPDX-License-Identifier: BSD-3-Clause
+ *
+ *  Copyright (c) 2023, rtegrity ltd. All rights reserved.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <string.h>
+#include <link.h>
+#include "section.h"
+#include "util.h"
+
+
+#ifdef __linux__
+#define Elf_Ehdr    ElfW(Ehdr)
+#define Elf_Phdr    ElfW(Phdr)
+#define Elf_Shdr    ElfW(Shdr)
+#endif
+
+#ifndef PT_GNU_RELRO
+#define PT_GNU_RELRO    0x6474e552
+#endif
+
+
+static int read_table(int fd, off_t offset, size_t size, int n, vec_t *v)
+{
+    char *buffer;
+
+    cheritree_vec_init(v, size, n + 1);
+    buffer = cheritree_vec_alloc(v, n);
+
+    return (pread(fd, buffer, size * n, offset) == (ssize_t)(size * n));
+}
+
+
+static void add_section(vec_t *v, addr_t start, addr_t end)
+{
+    section_t *section;
+
+    if (start >= end) return;
+
+    section = (section_t *)cheritree_vec_alloc(v, 1);
+    section->start = start;
+    section->end = end;
+}
+
+
+static int is_section(const Elf_Shdr *shdr)
+{
+    if (!(shdr->sh_flags & SHF_ALLOC) || (shdr->sh_flags & SHF_TLS))
+        return 0;
+
+    return (shdr->sh_flags & (SHF_EXECINSTR | SHF_WRITE)) != 0;
+}
+
+
+static int compare_section(const void *a, const void *b)
+{
+    addr_t x = ((const section_t *)a)->start, y = ((const section_t *)b)->start;
+
+    return (x > y) - (x < y);
+}
+
+
+/*
+ *  Sort the sections and merge those that overlap or are adjacent,
+ *  so that they can be searched by address.
+ */
+static void merge_sections(vec_t *v)
+{
+    int i, n = 0;
+
+    qsort(v->addr, getcount(v), sizeof(section_t), compare_section);
+
+    for (i = 0; i < getcount(v); i++) {
+        section_t *section = getsection(v, i);
+
+        if (n && section->start <= getsection(v, n-1)->end) {
+            if (section->end > getsection(v, n-1)->end)
+                getsection(v, n-1)->end = section->end;
+        }
+
+        else *getsection(v, n++) = *section;
+    }
+
+    v->count = n;
+}
+
+
+/*
+ *  Load the text, data and bss sections of an image, together with
+ *  its loaded and relocation read-only segments, from the ELF headers.
+ *
+ *  Note: The section headers aren't loaded, so they are read from the
+ *  file once when the image is first seen. Only the ranges that they
+ *  cover are kept, sorted and merged.
+ */
+int cheritree_load_sections(const char *path, vec_t *v)
+{
+    addr_t pagesize = getpagesize(), base = ~(addr_t)0;
+    vec_t phdrs, shdrs;
+    Elf_Ehdr ehdr;
+    int fd, i;
+
+    cheritree_vec_init(v, sizeof(section_t), 16);
+
+    if ((fd = open(path, O_RDONLY)) < 0) return 0;
+
+    if (pread(fd, &ehdr, sizeof(ehdr), 0) != sizeof(ehdr) ||
+            memcmp(ehdr.e_ident, ELFMAG, SELFMAG) ||
+            ehdr.e_phentsize != sizeof(Elf_Phdr) ||
+            ehdr.e_shentsize != sizeof(Elf_Shdr)) {
+        close(fd);
+        return 0;
+    }
+
+    if (!read_table(fd, ehdr.e_phoff, sizeof(Elf_Phdr), ehdr.e_phnum, &phdrs) ||
+            !read_table(fd, ehdr.e_shoff, sizeof(Elf_Shdr), ehdr.e_shnum, &shdrs)) {
+        cheritree_vec_delete(&phdrs);
+        cheritree_vec_delete(&shdrs);
+        close(fd);
+        return 0;
+    }
+
+    close(fd);
+
+    // The image is based at its first loaded page
+
+    for (i = 0; i < ehdr.e_phnum; i++) {
+        const Elf_Phdr *phdr = (Elf_Phdr *)cheritree_vec_get(&phdrs, i);
+
+        if (phdr->p_type == PT_LOAD && phdr->p_vaddr < base)
+            base = phdr->p_vaddr & ~(pagesize - 1);
+    }
+
+    for (i = 0; i < ehdr.e_shnum; i++) {
+        const Elf_Shdr *shdr = (Elf_Shdr *)cheritree_vec_get(&shdrs, i);
+
+        if (is_section(shdr) && shdr->sh_addr >= base)
+            add_section(v, shdr->sh_addr - base,
+                shdr->sh_addr - base + shdr->sh_size);
+    }
+
+    for (i = 0; i < ehdr.e_phnum; i++) {
+        const Elf_Phdr *phdr = (Elf_Phdr *)cheritree_vec_get(&phdrs, i);
+        addr_t start = phdr->p_vaddr - base;
+
+        if (phdr->p_type == PT_LOAD || phdr->p_type == PT_GNU_RELRO)
+            add_section(v, start, start + phdr->p_memsz);
+    }
+
+    cheritree_vec_delete(&phdrs);
+    cheritree_vec_delete(&shdrs);
+
+    if (getcount(v)) {
+        merge_sections(v);
+        cheritree_vec_trim(v);
+    }
+
+    return 1;
+}
+
@@ -0,0 +1,36 @@
+/*-
+ *  SPDX-License-Identifier: BSD-3-Clause
+ *
+ *  Copyright (c) 2023, rtegrity ltd. All rights reserved.
+ */
+
+#ifndef _CHERITREE_SECTION_H_
+#define _CHERITREE_SECTION_H_
+
+#include <stdint.h>
+#include "util.h"
+
+
+/*
+ *  Image section.
+ *
+ *  Note: Sections are read from the ELF headers of each image and
+ *  are held relative to the start of its first loaded page, which
+ *  is the base of the image's mappings. They are sorted and don't
+ *  overlap.
+ */
+typedef struct section {
+    addr_t start;               // Start offset
+    addr_t end;                 // End offset
+} section_t;
+
+int cheritree_load_sections(const char *path, vec_t *v);
+
+
+/*
+ *  Access functions.
+ */
+#define getsection(v,i)     ((section_t *)cheritree_vec_get((v),(i)))
+
+
+#endif /* _CHERITREE_SECTION_H_ */
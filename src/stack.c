@@ -0,0 +1,128 @@
+/*-
+ *  SPDX-License-Identifier: BSD-3-Clause
+ *
+ *  Copyright (c) 2023, rtegrity ltd. All rights reserved.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include "cheritree.h"
+#include "stack.h"
+#include "util.h"
+
+
+#ifndef MAP_STACK
+#define MAP_STACK       0
+#endif
+
+void *cheritree_stacks[STACK_COUNT];
+static char *stacks[STACK_COUNT];
+static size_t sizes[STACK_COUNT];
+
+
+/*
+ *  Reserve a stack, with a guard page below it.
+ */
+static char *reserve_stack(size_t size)
+{
+    size_t pagesize = getpagesize();
+    char *cp = mmap(NULL, size + pagesize, PROT_READ | PROT_WRITE,
+        MAP_ANON | MAP_PRIVATE | MAP_NORESERVE | MAP_STACK, -1, 0);
+
+    if (cp == MAP_FAILED) return NULL;
+
+    mprotect(cp, pagesize, PROT_NONE);
+    return cp + pagesize;
+}
+
+
+/*
+ *  Set the size of the scanner stacks, replacing those that are
+ *  idle. Returns zero if any of them can't be reserved.
+ *
+ *  Note: A stack that is in use keeps its size.
+ */
+int cheritree_set_stack_size(size_t size)
+{
+    size_t pagesize = getpagesize();
+    int i, rc = 1;
+
+    size = (size + pagesize - 1) & ~(pagesize - 1);
+    if (size < STACK_MIN) size = STACK_MIN;
+
+    for (i = 0; i < STACK_COUNT; i++) {
+        void *top = __atomic_exchange_n(&cheritree_stacks[i],
+            NULL, __ATOMIC_ACQUIRE);
+
+        if (!top && stacks[i]) continue;
+
+        if (stacks[i]) munmap(stacks[i] - pagesize, sizes[i] + pagesize);
+
+        if ((stacks[i] = reserve_stack(size)) == NULL) {
+            sizes[i] = 0;
+            rc = 0;
+            continue;
+        }
+
+        sizes[i] = size;
+        __atomic_store_n(&cheritree_stacks[i],
+            stacks[i] + size, __ATOMIC_RELEASE);
+    }
+
+    return rc;
+}
+
+
+/*
+ *  Reserve the stacks when the library is loaded, sized from the
+ *  stack limit, since the stubs can't reserve them.
+ */
+__attribute__((constructor))
+static void init_stacks()
+{
+    size_t size = STACK_MAX;
+    struct rlimit rl;
+
+    if (getrlimit(RLIMIT_STACK, &rl) == 0 &&
+            rl.rlim_cur != RLIM_INFINITY && rl.rlim_cur < STACK_MAX)
+        size = rl.rlim_cur;
+
+    cheritree_set_stack_size(size);
+}
+
+
+/*
+ *  Returns the end of the scanner stack holding an address, or
+ *  zero if there is none.
+ *
+ *  Note: This can be called from a signal handler.
+ */
+addr_t cheritree_stack_end(addr_t addr)
+{
+    int i;
+
+    for (i = 0; i < STACK_COUNT; i++)
+        if (stacks[i] && (addr_t)stacks[i] <= addr &&
+                addr < (addr_t)stacks[i] + sizes[i])
+            return (addr_t)stacks[i] + sizes[i];
+
+    return 0;
+}
+
+
+/*
+ *  Exclude all of the scanner stacks, including those in use by
+ *  other threads.
+ */
+void cheritree_stack_exclude(map_t *exclude)
+{
+    int i;
+
+    for (i = 0; i < STACK_COUNT; i++)
+        if (stacks[i])
+            cheritree_map_add(exclude, (addr_t)stacks[i],
+                (addr_t)stacks[i] + sizes[i]);
+}
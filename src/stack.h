@@ -0,0 +1,36 @@
+/*-
+ *  SPDX-License-Identifier: BSD-3-Clause
+ *
+ *  Copyright (c) 2023, rtegrity ltd. All rights reserved.
+ */
+
+#ifndef _CHERITREE_STACK_H_
+#define _CHERITREE_STACK_H_
+
+#include "util.h"
+
+
+/*
+ *  Scanner stacks.
+ *
+ *  Note: The stubs run the traversal on a stack owned by cheritree,
+ *  so that it doesn't overwrite the residual capabilities below the
+ *  caller or overflow a small thread stack. The stacks are reserved
+ *  when the library is loaded, sized from the stack limit, and only
+ *  the pages that are used are populated. The top of each idle stack
+ *  is held in cheritree_stacks, and a stub claims one by swapping it
+ *  for NULL, so that it doesn't make any calls on the caller's stack.
+ *  If none is free, the traversal runs on the caller's stack.
+ */
+extern void *cheritree_stacks[];
+
+addr_t cheritree_stack_end(addr_t addr);
+void cheritree_stack_exclude(map_t *exclude);
+
+
+#define STACK_COUNT             8                       // Also in stubs.S
+#define STACK_MIN               (1024 * 1024)           // Smallest stack
+#define STACK_MAX               (256 * 1024 * 1024)     // Unlimited stack
+
+
+#endif /* _CHERITREE_STACK_H_ */
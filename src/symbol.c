@@ -8,22 +8,25 @@
 #include <stdlib.h>
 #include <inttypes.h>
 #include <string.h>
+#include <pthread.h>
 #include "symbol.h"
 #include "mapping.h"
 #include "util.h"
 
 
-static vec_t images;
+static vec_t *images;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
 
 
 static image_t *find_image(const char *path)
 {
+    vec_t *v = cheritree_vec_current(&images);
     int i;
 
-    if (!path || !*path) return NULL;
+    if (!path || !*path || !v) return NULL;
 
-    for (i = 0; i < getcount(&images); i++) {
-        image_t *image = getimage(&images, i);
+    for (i = 0; i < getcount(v); i++) {
+        image_t *image = getimage(v, i);
 
         if (!strcmp(getpath(image), path))
             return image;
@@ -33,28 +36,101 @@ static image_t *find_image(const char *path)
 }
 
 
-static void print_symbol(const symbol_t *symbol)
+/*
+ *  Decode a name, starting from the beginning of its block.
+ */
+const char *cheritree_symbol_name(const symbol_t *symbol, char *buf, size_t len)
+{
+    const image_t *image = (symbol) ? symbol->image : NULL;
+    const char *cp;
+    size_t prefix;
+    int i;
+
+    if (!image || !len) return "";
+
+    cp = image->names + image->blocks[symbol->index / SYMBOL_BLOCK];
+    strncpy(buf, cp, len - 1);
+    buf[len - 1] = 0;
+
+    for (i = 0; i < symbol->index % SYMBOL_BLOCK; i++) {
+        cp += strlen(cp) + 1;
+        prefix = (unsigned char)*cp++;
+
+        if (prefix < len - 1) {
+            strncpy(buf + prefix, cp, len - 1 - prefix);
+            buf[len - 1] = 0;
+        }
+    }
+
+    return buf;
+}
+
+
+static void get_symbol(const image_t *image, int index, symbol_t *symbol)
 {
-    printf("%#" PRIxADDR " %c %s\n", symbol->value,
-        symbol->type, getname(symbol));
+    symbol->image = image;
+    symbol->index = index;
+    symbol->value = image->values[index];
+    symbol->type = image->types[index];
 }
 
 
 void cheritree_print_symbols(const char *path)
 {
     const image_t *image = find_image(path);
+    char name[SYMBOL_NAMELEN];
+    symbol_t symbol;
     int i;
 
     if (!image) return;
 
-    for (i = 0; i < getcount(&image->symbols); i++)
-        print_symbol(getsymbol(&image->symbols, i));
+    for (i = 0; i < image->count; i++) {
+        get_symbol(image, i, &symbol);
+        printf("%#" PRIxADDR " %c %s\n", symbol.value, symbol.type,
+            cheritree_symbol_name(&symbol, name, sizeof(name)));
+    }
+}
+
+
+/*
+ *  Symbols being loaded.
+ *
+ *  Note: The values are first, since the loader is passed as the
+ *  vector being loaded.
+ */
+typedef struct loader {
+    vec_t values;           // Symbol values
+    vec_t types;            // Symbol types
+    vec_t blocks;           // Offset of each block of names
+    vec_t names;            // Front coded names
+    char last[SYMBOL_NAMELEN];  // Previous name
+} loader_t;
+
+
+static void add_name(loader_t *l, const char *name)
+{
+    size_t prefix = 0, len;
+
+    if (getcount(&l->values) % SYMBOL_BLOCK == 0)
+        *(int *)cheritree_vec_alloc(&l->blocks, 1) = getcount(&l->names);
+
+    else {
+        while (prefix < 255 && name[prefix] && name[prefix] == l->last[prefix])
+            prefix++;
+
+        *(char *)cheritree_vec_alloc(&l->names, 1) = (char)prefix;
+    }
+
+    len = strlen(name + prefix) + 1;
+    memcpy(cheritree_vec_alloc(&l->names, len), name + prefix, len);
+    strcpy(l->last, name);
 }
 
 
 static int load_symbol(char *buffer, vec_t *v)
 {
-    char type[2], name[1024];
+    char type[2], name[SYMBOL_NAMELEN];
+    loader_t *l = (loader_t *)v;
     addr_t value;
 
     if (sscanf(buffer, "%" PRIxADDR " %1s %1023s", &value, type, name) != 3)
@@ -62,78 +138,199 @@ static int load_symbol(char *buffer, vec_t *v)
 
     if (name[0] == '$') return 1;
 
-    symbol_t *symbol = (symbol_t *)cheritree_vec_alloc(v, 1);
-    setname(symbol, name);
-    symbol->value = value;
-    symbol->type = type[0];
+    add_name(l, name);
+    *(addr_t *)cheritree_vec_alloc(&l->values, 1) = value;
+    *(char *)cheritree_vec_alloc(&l->types, 1) = type[0];
     return 1;
 }
 
 
-void cheritree_load_symbols(const char *path)
+static void init_loader(loader_t *l)
+{
+    cheritree_vec_init(&l->values, sizeof(addr_t), 1024);
+    cheritree_vec_init(&l->types, sizeof(char), 1024);
+    cheritree_vec_init(&l->blocks, sizeof(int), 64);
+    cheritree_vec_init(&l->names, sizeof(char), 16 * 1024);
+    l->last[0] = 0;
+}
+
+
+static void delete_loader(loader_t *l)
+{
+    cheritree_vec_delete(&l->values);
+    cheritree_vec_delete(&l->types);
+    cheritree_vec_delete(&l->blocks);
+    cheritree_vec_delete(&l->names);
+}
+
+
+static int load_image(image_t *image, const char *path)
 {
+    vec_t sections;
     char cmd[2048];
- 
-    if (images.addr == 0)
-        cheritree_vec_init(&images, sizeof(image_t), 1024);
+    loader_t l;
+
+    setpath(image, path);
+    init_loader(&l);
+
+    sprintf(cmd, "nm -ne --defined-only %s 2>/dev/null", path);
+
+    if (!cheritree_load_from_cmd(cmd, load_symbol, (vec_t *)&l)) {
+        delete_loader(&l);
+        init_loader(&l);
+
+        // Retry with dynamic symbols
+        sprintf(cmd, "nm -Dne --defined-only %s", path);
+
+        if (!cheritree_load_from_cmd(cmd, load_symbol, (vec_t *)&l)) {
+            delete_loader(&l);
+            return 0;
+        }
+    }
+
+    cheritree_vec_trim(&l.types);
+    cheritree_vec_trim(&l.blocks);
+    cheritree_vec_trim(&l.names);
+
+    image->count = getcount(&l.values);
+    image->values = (addr_t *)l.values.addr;
+    image->types = l.types.addr;
+    image->blocks = (int *)l.blocks.addr;
+    image->names = l.names.addr;
+
+    if (cheritree_load_sections(path, &sections)) {
+        image->nsections = getcount(&sections);
+        image->sections = (section_t *)sections.addr;
+    }
+
+    return 1;
+}
+
+
+/*
+ *  Load the symbols for an image.
+ *
+ *  Note: The symbols of an image are never changed once loaded, so
+ *  a new version of the image list shares them with the old one.
+ */
+void cheritree_load_symbols(const char *path)
+{
+    vec_t *current, v;
 
     if (!path || !*path) return;
     if (find_image(path)) return;
 
-    image_t *image = (image_t *)cheritree_vec_alloc(&images, 1);
+    pthread_mutex_lock(&lock);
 
-    cheritree_vec_init(&image->symbols, sizeof(symbol_t), 1024);
-    setpath(image, path);
+    if (find_image(path)) {
+        pthread_mutex_unlock(&lock);
+        return;
+    }
 
-    sprintf(cmd, "nm -ne --defined-only %s 2>/dev/null", path);
-    if (cheritree_load_from_cmd(cmd, load_symbol, &image->symbols)) return;
+    current = cheritree_vec_current(&images);
+    cheritree_vec_init(&v, sizeof(image_t), 64);
+
+    if (current && getcount(current))
+        memcpy(cheritree_vec_alloc(&v, getcount(current)),
+            current->addr, getcount(current) * sizeof(image_t));
+
+    if (!load_image((image_t *)cheritree_vec_alloc(&v, 1), path)) {
+        fprintf(stderr, "Unable to load symbols");
+        exit(1);
+    }
+
+    cheritree_vec_publish(&images, &v);
+    pthread_mutex_unlock(&lock);
+}
+
+
+/*
+ *  Hold the symbol lock across a fork.
+ */
+void cheritree_symbol_lock()
+{
+    pthread_mutex_lock(&lock);
+}
+
+
+void cheritree_symbol_unlock()
+{
+    pthread_mutex_unlock(&lock);
+}
+
+
+/*
+ *  Find the number of symbols with a value not above the offset.
+ */
+static int count_symbols(const image_t *image, addr_t offset)
+{
+    int low = 0, high = image->count;
 
-    // Retry with dynamic symbols
-    sprintf(cmd, "nm -Dne --defined-only %s", path);
-    if (cheritree_load_from_cmd(cmd, load_symbol, &image->symbols)) return;
+    while (low < high) {
+        int mid = low + (high - low) / 2;
 
-    fprintf(stderr, "Unable to load symbols");
-    exit(1);
+        if (image->values[mid] <= offset) low = mid + 1;
+        else high = mid;
+    }
+
+    return low;
 }
 
 
-const char *cheritree_find_type(const char *path,
+/*
+ *  Check whether any section of an image overlaps a range, with a
+ *  binary search for the first section ending after its start.
+ */
+int cheritree_find_section(const char *path,
     addr_t base, addr_t start, addr_t end)
 {
     const image_t *image = find_image(path);
-    int i;
-
-    if (!image) return NULL;
+    int low = 0, high;
 
-    for (i = 0; i < getcount(&image->symbols); i++) {
-        const symbol_t *sym = getsymbol(&image->symbols, i);
-        addr_t addr = base + sym->value;
+    if (!image || start < base) return 0;
 
-        if (addr > end) break;
+    for (high = image->nsections; low < high; ) {
+        int mid = low + (high - low) / 2;
 
-        if (start <= addr && addr < end) {
-            if (strchr("Tt", sym->type)) return "text";
-            if (strchr("BCb", sym->type)) return "bss";
-            if (strchr("DRVdr", sym->type)) return "data";
-        }
+        if (base + image->sections[mid].end <= start) low = mid + 1;
+        else high = mid;
     }
 
-    return NULL;
+    return low < image->nsections && base + image->sections[low].start < end;
 }
 
 
-symbol_t *cheritree_find_symbol(const char *path,
-    addr_t base, addr_t addr)
+int cheritree_find_symbol(const char *path,
+    addr_t base, addr_t addr, symbol_t *symbol)
 {
     const image_t *image = find_image(path);
     int i;
 
-    if (!image) return NULL;
+    symbol->image = NULL;
+
+    if (!image || addr < base) return 0;
+    if ((i = count_symbols(image, addr - base)) == 0) return 0;
+
+    get_symbol(image, i - 1, symbol);
+    return 1;
+}
 
-    for (i = 0; i < getcount(&image->symbols); i++) {
-        const symbol_t *sym = getsymbol(&image->symbols, i);
-        if (base + sym->value > addr) break;
-    }
 
-    return (i) ? getsymbol(&image->symbols, i-1) : NULL;
+/*
+ *  Find the symbols for a sorted array of addresses in an image,
+ *  with a single pass through the symbols.
+ */
+void cheritree_find_symbols(const char *path, addr_t base,
+    const addr_t *addrs, int n, symbol_t *found)
+{
+    const image_t *image = find_image(path);
+    int i, j = 0;
+
+    for (i = 0; i < n; i++) {
+        while (image && j < image->count && base + image->values[j] <= addrs[i])
+            j++;
+
+        found[i].image = NULL;
+        if (j) get_symbol(image, j - 1, &found[i]);
+    }
 }
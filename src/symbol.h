@@ -8,33 +8,53 @@
 #define _CHERITREE_SYMBOL_H_
 
 #include <stdint.h>
+#include "section.h"
 #include "util.h"
 
 
 /*
  *  Symbol store.
+ *
+ *  Note: The symbols of each image are held as separate arrays, so
+ *  that searching the sorted values doesn't touch the names. Names
+ *  are front coded in blocks, with the first name of each block held
+ *  in full and the others as the length of the prefix shared with
+ *  the previous name followed by the rest of the name.
  */
 typedef struct image {
-    vec_t symbols;          // Symbols
     string_t pathstr;       // Pathname
+    int count;              // Number of symbols
+    addr_t *values;         // Symbol values (sorted)
+    char *types;            // Symbol types
+    int *blocks;            // Offset of each block of names
+    char *names;            // Front coded names
+    int nsections;          // Number of sections
+    section_t *sections;    // Sections (sorted)
 } image_t;
 
 typedef struct symbol {
     addr_t value;           // Symbol value
-    string_t namestr;       // Symbol name
+    const image_t *image;   // Image, or NULL if none
+    int index;              // Index within image
     char type;              // Type
 } symbol_t;
 
 void cheritree_load_symbols(const char *path);
+void cheritree_symbol_lock();
+void cheritree_symbol_unlock();
 void cheritree_print_symbols(const char *path);
-symbol_t *cheritree_find_symbol(const char *path, addr_t base, addr_t addr);
-const char *cheritree_find_type(const char *path, addr_t base, addr_t start, addr_t end);
+int cheritree_find_symbol(const char *path, addr_t base, addr_t addr, symbol_t *symbol);
+void cheritree_find_symbols(const char *path, addr_t base,
+    const addr_t *addrs, int n, symbol_t *found);
+const char *cheritree_symbol_name(const symbol_t *symbol, char *buf, size_t len);
+int cheritree_find_section(const char *path, addr_t base, addr_t start, addr_t end);
 
 
 /*
  *  Access functions.
  */
-#define getsymbol(v,i)      (symbol_t *)cheritree_vec_get((v),(i))
-#define getimage(v,i)       (image_t *)cheritree_vec_get((v),(i))
+#define getimage(v,i)       ((image_t *)cheritree_vec_get((v),(i)))
+#define SYMBOL_BLOCK        16
+#define SYMBOL_NAMELEN      1024
 
 #endif /* _CHERITREE_SYMBOL_H_ */
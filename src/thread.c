@@ -0,0 +1,257 @@
+/*-
+ *  SPDX-License-Identifier: BSD-3-Clause
+ *
+ *  Copyright (c) 2023, rtegrity ltd. All rights reserved.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sched.h>
+#include <errno.h>
+#include <string.h>
+#include <pthread.h>
+#ifdef __linux__
+#include <dirent.h>
+#include <sys/syscall.h>
+#endif
+#ifdef __FreeBSD__
+#include <sys/thr.h>
+#endif
+#include "thread.h"
+#include "util.h"
+
+
+#define THREAD_SIGNAL       (SIGRTMIN + 4)
+#define THREAD_TIMEOUT      1000    // Milliseconds
+
+static vec_t *capturing;
+static int handlers;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+
+#ifdef __linux__
+static int get_tid()
+{
+    return syscall(SYS_gettid);
+}
+
+
+static int signal_thread(int tid)
+{
+    return syscall(SYS_tgkill, getpid(), tid, THREAD_SIGNAL) == 0;
+}
+
+
+static int load_threads(vec_t *v)
+{
+    DIR *dir = opendir("/proc/self/task");
+    struct dirent *entry;
+
+    if (!dir) return 0;
+
+    while ((entry = readdir(dir)) != NULL) {
+        int tid = atoi(entry->d_name);
+
+        if (tid > 0)
+            ((thread_t *)cheritree_vec_alloc(v, 1))->tid = tid;
+    }
+
+    closedir(dir);
+    return 1;
+}
+#endif /* __linux__ */
+
+
+#ifdef __FreeBSD__
+static int get_tid()
+{
+    long tid;
+
+    thr_self(&tid);
+    return (int)tid;
+}
+
+
+static int signal_thread(int tid)
+{
+    return thr_kill(tid, THREAD_SIGNAL) == 0;
+}
+
+
+static int load_thread(char *buffer, vec_t *v)
+{
+    int pid, tid;
+
+    if (sscanf(buffer, "%d %d", &pid, &tid) != 2 || pid != getpid())
+        return 1;
+
+    ((thread_t *)cheritree_vec_alloc(v, 1))->tid = tid;
+    return 1;
+}
+
+
+static int load_threads(vec_t *v)
+{
+    char cmd[2048];
+
+    sprintf(cmd, "procstat -t %d", getpid());
+    return cheritree_load_from_cmd(cmd, load_thread, v);
+}
+#endif /* __FreeBSD__ */
+
+
+/*
+ *  Get the stack pointer from the saved registers, since the handler
+ *  may be running on an alternate signal stack. Returns zero if it
+ *  isn't known for the platform.
+ */
+static addr_t get_stack(ucontext_t *uc)
+{
+#if defined(__linux__) && defined(__x86_64__)
+    return (addr_t)uc->uc_mcontext.gregs[REG_RSP];
+#elif defined(__linux__) && defined(__aarch64__)
+    return (addr_t)uc->uc_mcontext.sp;
+#elif defined(__FreeBSD__) && defined(__CHERI_PURE_CAPABILITY__)
+    return (addr_t)uc->uc_mcontext.mc_capregs.cap_sp;
+#elif defined(__FreeBSD__) && defined(__aarch64__)
+    return (addr_t)uc->uc_mcontext.mc_gpregs.gp_sp;
+#elif defined(__FreeBSD__) && defined(__x86_64__)
+    return (addr_t)uc->uc_mcontext.mc_rsp;
+#else
+    (void)uc;
+    return 0;
+#endif
+}
+
+
+/*
+ *  Signal handler to copy the saved registers.
+ */
+static void capture_thread(int sig, siginfo_t *info, void *context)
+{
+    int saved = errno, tid = get_tid(), i;
+    vec_t *threads;
+
+    (void)sig;
+    (void)info;
+
+    __atomic_add_fetch(&handlers, 1, __ATOMIC_SEQ_CST);
+    threads = __atomic_load_n(&capturing, __ATOMIC_SEQ_CST);
+
+    for (i = 0; threads && i < getcount(threads); i++) {
+        thread_t *thread = getthread(threads, i);
+
+        if (thread->tid != tid) continue;
+        if (__atomic_load_n(&thread->state, __ATOMIC_ACQUIRE) != THREAD_SIGNALLED)
+            continue;
+
+        memcpy(&thread->context, context, sizeof(thread->context));
+        thread->stack = get_stack((ucontext_t *)context);
+        if (!thread->stack) thread->stack = (addr_t)&tid;
+        __atomic_store_n(&thread->state, THREAD_CAPTURED, __ATOMIC_RELEASE);
+    }
+
+    __atomic_sub_fetch(&handlers, 1, __ATOMIC_SEQ_CST);
+    errno = saved;
+}
+
+
+static int is_signalled(vec_t *threads)
+{
+    int i;
+
+    for (i = 0; i < getcount(threads); i++)
+        if (__atomic_load_n(&getthread(threads, i)->state,
+                __ATOMIC_ACQUIRE) == THREAD_SIGNALLED)
+            return 1;
+
+    return 0;
+}
+
+
+/*
+ *  Capture the registers of all threads, other than the caller.
+ *  Returns the number of threads captured.
+ *
+ *  Note: The handler is left installed, since a late signal would
+ *  otherwise terminate the process. Threads that don't respond
+ *  within the timeout (e.g. with the signal blocked) are skipped.
+ *  Captures are serialised, since the handler can only serve one
+ *  capture at a time. A thread waiting here can still be captured.
+ */
+int cheritree_capture_threads(vec_t *threads)
+{
+    static int installed;
+    int self = get_tid(), i, n = 0;
+
+    pthread_mutex_lock(&lock);
+
+    if (!installed) {
+        struct sigaction sa;
+
+        memset(&sa, 0, sizeof(sa));
+        sa.sa_sigaction = capture_thread;
+        sa.sa_flags = SA_SIGINFO | SA_RESTART;
+        sigfillset(&sa.sa_mask);
+
+        if (sigaction(THREAD_SIGNAL, &sa, NULL) != 0) {
+            pthread_mutex_unlock(&lock);
+            return 0;
+        }
+
+        installed = 1;
+    }
+
+    if (!load_threads(threads)) {
+        pthread_mutex_unlock(&lock);
+        return 0;
+    }
+
+    __atomic_store_n(&capturing, threads, __ATOMIC_SEQ_CST);
+
+    for (i = 0; i < getcount(threads); i++) {
+        thread_t *thread = getthread(threads, i);
+
+        if (thread->tid == self) continue;
+
+        __atomic_store_n(&thread->state, THREAD_SIGNALLED, __ATOMIC_RELEASE);
+
+        if (!signal_thread(thread->tid))
+            __atomic_store_n(&thread->state, THREAD_NONE, __ATOMIC_RELEASE);
+    }
+
+    for (i = 0; i < THREAD_TIMEOUT && is_signalled(threads); i++)
+        usleep(1000);
+
+    // Wait for any handlers still running
+
+    __atomic_store_n(&capturing, NULL, __ATOMIC_SEQ_CST);
+
+    while (__atomic_load_n(&handlers, __ATOMIC_SEQ_CST))
+        sched_yield();
+
+    pthread_mutex_unlock(&lock);
+
+    for (i = 0; i < getcount(threads); i++)
+        if (getthread(threads, i)->state == THREAD_CAPTURED) n++;
+
+    return n;
+}
+
+
+/*
+ *  Hold the capture lock across a fork.
+ */
+void cheritree_thread_lock()
+{
+    pthread_mutex_lock(&lock);
+}
+
+
+void cheritree_thread_unlock()
+{
+    pthread_mutex_unlock(&lock);
+}
@@ -0,0 +1,46 @@
+/*-
+ *  SPDX-License-Identifier: BSD-3-Clause
+ *
+ *  Copyright (c) 2023, rtegrity ltd. All rights reserved.
+ */
+
+#ifndef _CHERITREE_THREAD_H_
+#define _CHERITREE_THREAD_H_
+
+#include <ucontext.h>
+#include "util.h"
+
+
+/*
+ *  Captured thread.
+ *
+ *  Note: Each thread copies its saved registers from the signal
+ *  handler and then continues, so no locks are held while waiting.
+ */
+typedef struct thread {
+    ucontext_t context;         // Saved registers
+    addr_t stack;               // Stack pointer
+    int tid;                    // Thread id
+    int state;                  // Capture state
+} thread_t;
+
+int cheritree_capture_threads(vec_t *threads);
+void cheritree_thread_lock();
+void cheritree_thread_unlock();
+
+
+/*
+ *  Capture state.
+ */
+#define THREAD_NONE             0
+#define THREAD_SIGNALLED        1
+#define THREAD_CAPTURED         2
+
+
+/*
+ *  Access functions.
+ */
+#define getthread(v,i)      ((thread_t *)cheritree_vec_get((v),(i)))
+
+
+#endif /* _CHERITREE_THREAD_H_ */
@@ -7,10 +7,24 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+#include <pthread.h>
 #include "util.h"
 
 
-static vec_t strings;
+#define STRING_CHUNKSIZE    (64 * 1024)
+#define STRING_MAXCHUNKS    4096
+
+static char *chunks[STRING_MAXCHUNKS];
+static int nchunks, used;
+static pthread_mutex_t stringlock = PTHREAD_MUTEX_INITIALIZER;
+
+static unsigned epoch;
+static int readers[2];
+static vec_t retired[2];
+static pthread_mutex_t retirelock = PTHREAD_MUTEX_INITIALIZER;
+
+static int target;
 
 
 /*
@@ -62,99 +76,527 @@ int cheritree_load_from_path(const char *path,
 }
 
 
+/*
+ *  Published versions of a vector.
+ *
+ *  Note: Readers are counted against the parity of the epoch in
+ *  which they started. Versions replaced during an epoch are freed
+ *  once no readers remain from the epoch before it, and the epoch
+ *  is then advanced. Nothing waits, so a reader can also publish.
+ */
+int cheritree_read_begin()
+{
+    unsigned e;
+
+    for (;;) {
+        e = __atomic_load_n(&epoch, __ATOMIC_SEQ_CST);
+        __atomic_add_fetch(&readers[e & 1], 1, __ATOMIC_SEQ_CST);
+
+        if (__atomic_load_n(&epoch, __ATOMIC_SEQ_CST) == e)
+            return e & 1;
+
+        __atomic_sub_fetch(&readers[e & 1], 1, __ATOMIC_SEQ_CST);
+    }
+}
+
+
+void cheritree_read_end(int e)
+{
+    __atomic_sub_fetch(&readers[e], 1, __ATOMIC_SEQ_CST);
+}
+
+
+vec_t *cheritree_vec_current(vec_t **pv)
+{
+    return __atomic_load_n(pv, __ATOMIC_ACQUIRE);
+}
+
+
+static void reclaim_versions()
+{
+    vec_t *v = &retired[(epoch + 1) & 1];
+    int i;
+
+    if (__atomic_load_n(&readers[(epoch + 1) & 1], __ATOMIC_SEQ_CST))
+        return;
+
+    for (i = 0; i < getcount(v); i++) {
+        vec_t *version = *(vec_t **)cheritree_vec_get(v, i);
+
+        cheritree_vec_delete(version);
+        free(version);
+    }
+
+    v->count = 0;
+    __atomic_add_fetch(&epoch, 1, __ATOMIC_SEQ_CST);
+}
+
+
+/*
+ *  Publish a new version, taking ownership of its elements.
+ */
+void cheritree_vec_publish(vec_t **pv, vec_t *v)
+{
+    vec_t *version = malloc(sizeof(vec_t)), *old;
+
+    if (version == NULL) {
+        fprintf(stderr, "CheriTree: Unable to allocate memory");
+        exit(1);
+    }
+
+    *version = *v;
+    pthread_mutex_lock(&retirelock);
+
+    if (!retired[0].size) {
+        cheritree_vec_init(&retired[0], sizeof(vec_t *), 16);
+        cheritree_vec_init(&retired[1], sizeof(vec_t *), 16);
+    }
+
+    old = __atomic_exchange_n(pv, version, __ATOMIC_SEQ_CST);
+
+    if (old)
+        *(vec_t **)cheritree_vec_alloc(&retired[epoch & 1], 1) = old;
+
+    reclaim_versions();
+    pthread_mutex_unlock(&retirelock);
+}
+
+
 /*
  *  Map of address ranges, grown on demand.
  *
  *  Note: Integers are used instead of pointers to minimise the
- *  number of capabilities introduced.
+ *  number of capabilities introduced. Overlapping ranges are merged,
+ *  and the ranges are held in a treap with nodes referenced by index,
+ *  so adding or finding a range takes logarithmic time.
+ */
+typedef struct mapnode {
+    range_t range;      // Range
+    int left;           // Earlier ranges (index + 1)
+    int right;          // Later ranges (index + 1)
+    unsigned priority;  // Random priority
+} mapnode_t;
+
+#define getmapnode(m,n)     ((mapnode_t *)cheritree_vec_get(&(m)->nodes, (n) - 1))
+
+
+void cheritree_map_init(map_t *m, int expect)
+{
+    cheritree_vec_init(&m->nodes, sizeof(mapnode_t), expect);
+    m->root = 0;
+    m->free = 0;
+    m->count = 0;
+    m->seed = 2463534242u;
+}
+
+
+static int alloc_mapnode(map_t *m, addr_t start, addr_t end)
+{
+    mapnode_t *node;
+    int n;
+
+    if ((n = m->free) != 0) {
+        node = getmapnode(m, n);
+        m->free = node->left;
+    }
+
+    else {
+        // Grow geometrically, since a map can hold millions of ranges
+
+        if (m->nodes.count == m->nodes.maxcount && m->nodes.maxcount > m->nodes.expect)
+            m->nodes.expect = m->nodes.maxcount;
+
+        node = (mapnode_t *)cheritree_vec_alloc(&m->nodes, 1);
+        n = getcount(&m->nodes);
+    }
+
+    m->seed ^= m->seed << 13;
+    m->seed ^= m->seed >> 17;
+    m->seed ^= m->seed << 5;
+
+    node->range.start = start;
+    node->range.end = end;
+    node->left = 0;
+    node->right = 0;
+    node->priority = m->seed;
+    m->count++;
+    return n;
+}
+
+
+static void free_mapnodes(map_t *m, int n)
+{
+    mapnode_t *node;
+
+    if (!n) return;
+
+    node = getmapnode(m, n);
+    free_mapnodes(m, node->left);
+    free_mapnodes(m, node->right);
+
+    node->left = m->free;
+    m->free = n;
+    m->count--;
+}
+
+
+/*
+ *  Split off the ranges that end before an address, leaving the
+ *  rest in *prest.
+ */
+static int split_before(map_t *m, int n, addr_t addr, int *prest)
+{
+    mapnode_t *node;
+    int left;
+
+    if (!n) {
+        *prest = 0;
+        return 0;
+    }
+
+    node = getmapnode(m, n);
+
+    if (node->range.end < addr) {
+        node->right = split_before(m, node->right, addr, prest);
+        return n;
+    }
+
+    left = split_before(m, node->left, addr, &node->left);
+    *prest = n;
+    return left;
+}
+
+
+/*
+ *  Split off the ranges that start at or before an address, leaving
+ *  the rest in *prest.
  */
-void cheritree_map_init(map_t *v, int expect)
+static int split_after(map_t *m, int n, addr_t addr, int *prest)
 {
-    cheritree_vec_init(v, sizeof(range_t), expect);
+    mapnode_t *node;
+    int left;
+
+    if (!n) {
+        *prest = 0;
+        return 0;
+    }
+
+    node = getmapnode(m, n);
+
+    if (node->range.start <= addr) {
+        node->right = split_after(m, node->right, addr, prest);
+        return n;
+    }
+
+    left = split_after(m, node->left, addr, &node->left);
+    *prest = n;
+    return left;
 }
 
 
-int cheritree_map_add(map_t *v, addr_t start, addr_t end)
+/*
+ *  Join two treaps, where the ranges in the first are all earlier.
+ */
+static int join_mapnodes(map_t *m, int a, int b)
 {
-    range_t *range = (range_t *)v->addr;
-    int i, j;
+    mapnode_t *x, *y;
+
+    if (!a) return b;
+    if (!b) return a;
 
-    for (i = 0; i < v->count; i++) {
-        if (range[i].start <= start && end <= range[i].end) return 0;
-        if (start <= range[i].end) break;
+    x = getmapnode(m, a);
+    y = getmapnode(m, b);
+
+    if (x->priority > y->priority) {
+        x->right = join_mapnodes(m, x->right, b);
+        return a;
     }
 
-    if (i < v->count && end >= range[i].start) {
-        if (start < range[i].start)
-            range[i].start = start;
+    y->left = join_mapnodes(m, a, y->left);
+    return b;
+}
 
-        if (end > range[i].end)
-            range[i].end = end;
 
-        for (j = i; j < v->count && end >= range[j].start; j++)
-            if (range[j].end > end)
-                range[i].end = range[j].end;
+/*
+ *  Add a range, merging any ranges it overlaps or adjoins.
+ *  Returns zero if it is already within a single range.
+ */
+int cheritree_map_add(map_t *m, addr_t start, addr_t end)
+{
+    int n = m->root, prev = 0, next = 0, added, left, mid, right, *link;
+    mapnode_t *node;
+
+    while (n) {
+        node = getmapnode(m, n);
 
-        if (j > i + 1) {
-            if (j < v->count)
-                memmove(&range[i+1], &range[j], (v->count-j) * sizeof(range_t));
-            v->count -= (j-i-1);
+        if (node->range.start > start) {
+            next = n;
+            n = node->left;
         }
 
+        else if (end <= node->range.end) return 0;
+
+        else {
+            prev = n;
+            n = node->right;
+        }
+    }
+
+    added = alloc_mapnode(m, start, end);
+
+    // A range that doesn't meet its neighbours is inserted in place,
+    // splitting only the subtree below it
+
+    if ((!prev || getmapnode(m, prev)->range.end < start) &&
+            (!next || getmapnode(m, next)->range.start > end)) {
+        node = getmapnode(m, added);
+
+        for (link = &m->root; *link &&
+                getmapnode(m, *link)->priority > node->priority; )
+            link = (getmapnode(m, *link)->range.start > start) ?
+                &getmapnode(m, *link)->left : &getmapnode(m, *link)->right;
+
+        node->left = split_before(m, *link, start, &node->right);
+        *link = added;
         return 1;
     }
 
-    cheritree_vec_alloc(v, 1);
-    range = (range_t *)v->addr;
+    left = split_before(m, m->root, start, &mid);
+    mid = split_after(m, mid, end, &right);
 
-    if (i < v->count - 1)
-        memmove(&range[i+1], &range[i], (v->count-i-1) * sizeof(range_t));
+    if (mid) {
+        for (n = mid; getmapnode(m, n)->left; n = getmapnode(m, n)->left);
+        if (getmapnode(m, n)->range.start < start) start = getmapnode(m, n)->range.start;
 
-    range[i].start = start;
-    range[i].end = end;
+        for (n = mid; getmapnode(m, n)->right; n = getmapnode(m, n)->right);
+        if (getmapnode(m, n)->range.end > end) end = getmapnode(m, n)->range.end;
+
+        free_mapnodes(m, mid);
+    }
+
+    node = getmapnode(m, added);
+    node->range.start = start;
+    node->range.end = end;
+
+    m->root = join_mapnodes(m, join_mapnodes(m, left, added), right);
     return 1;
 }
 
 
-int cheritree_map_find(map_t *v, addr_t addr, range_t *prange)
+/*
+ *  Remove a range, trimming any ranges it overlaps.
+ */
+void cheritree_map_remove(map_t *m, addr_t start, addr_t end)
 {
-    range_t *range = (range_t *)v->addr;
-    int i;
+    int n, left, mid, right;
+    range_t first, last;
 
-    for (i = 0; i < v->count; i++) {
-        if (range[i].start <= addr && addr < range[i].end) {
-            *prange = range[i];
+    if (end <= start) return;
+
+    left = split_before(m, m->root, start + 1, &mid);
+    mid = split_after(m, mid, end - 1, &right);
+
+    if (mid) {
+        for (n = mid; getmapnode(m, n)->left; n = getmapnode(m, n)->left);
+        first = getmapnode(m, n)->range;
+
+        for (n = mid; getmapnode(m, n)->right; n = getmapnode(m, n)->right);
+        last = getmapnode(m, n)->range;
+
+        free_mapnodes(m, mid);
+
+        // Keep the parts of the first and last ranges outside
+
+        if (first.start < start)
+            left = join_mapnodes(m, left, alloc_mapnode(m, first.start, start));
+
+        if (last.end > end)
+            right = join_mapnodes(m, alloc_mapnode(m, end, last.end), right);
+    }
+
+    m->root = join_mapnodes(m, left, right);
+}
+
+
+int cheritree_map_find(map_t *m, addr_t addr, range_t *prange)
+{
+    int n = m->root;
+
+    while (n) {
+        mapnode_t *node = getmapnode(m, n);
+
+        if (addr < node->range.start) n = node->left;
+        else if (addr >= node->range.end) n = node->right;
+
+        else {
+            *prange = node->range;
             return 1;
         }
-        
-        if (addr <= range[i].end) break;
     }
 
     return 0;
 }
 
 
-void cheritree_map_print(map_t *v)
+/*
+ *  Find the first range that ends after an address, which is
+ *  either the range holding it or the next range.
+ */
+int cheritree_map_next(map_t *m, addr_t addr, range_t *prange)
+{
+    int n = m->root, found = 0;
+
+    while (n) {
+        mapnode_t *node = getmapnode(m, n);
+
+        if (node->range.end > addr) {
+            *prange = node->range;
+            found = 1;
+            n = node->left;
+        }
+
+        else n = node->right;
+    }
+
+    return found;
+}
+
+
+static void print_mapnodes(map_t *m, int n)
+{
+    mapnode_t *node;
+
+    if (!n) return;
+
+    node = getmapnode(m, n);
+    print_mapnodes(m, node->left);
+    printf("%" PRIxADDR "-%" PRIxADDR "\n", node->range.start, node->range.end);
+    print_mapnodes(m, node->right);
+}
+
+
+void cheritree_map_print(map_t *m)
 {
-    range_t *range = (range_t *)v->addr;
+    printf("Map at %p with %d entries:\n", m, getcount(m));
+    print_mapnodes(m, m->root);
+}
+
+
+void cheritree_map_reset(map_t *m)
+{
+    m->nodes.count = 0;
+    m->root = 0;
+    m->free = 0;
+    m->count = 0;
+}
+
+
+void cheritree_map_delete(map_t *m)
+{
+    cheritree_vec_delete(&m->nodes);
+    m->root = 0;
+    m->free = 0;
+    m->count = 0;
+}
+
+
+/*
+ *  Hash of fixed size elements, grown on demand.
+ *
+ *  Note: The key is held at the start of each element. Elements
+ *  are stored in a linear vector and the table holds indexes, so
+ *  element pointers are only valid until the next addition.
+ */
+void cheritree_hash_init(hash_t *h, size_t size, size_t keysize, int expect)
+{
+    cheritree_vec_init(&h->elements, size, expect);
+    h->table = NULL;
+    h->tablesize = 0;
+    h->keysize = keysize;
+}
+
+
+static unsigned hash_key(const hash_t *h, const void *key)
+{
+    const unsigned char *cp = (const unsigned char *)key;
+    unsigned hash = 2166136261u;
+    size_t i;
+
+    for (i = 0; i < h->keysize; i++)
+        hash = (hash ^ cp[i]) * 16777619u;
+
+    return hash;
+}
+
+
+static int *hash_slot(const hash_t *h, const void *key)
+{
+    unsigned i = hash_key(h, key) & (h->tablesize - 1);
+
+    while (h->table[i] && memcmp(cheritree_vec_get(&h->elements,
+            h->table[i] - 1), key, h->keysize))
+        i = (i + 1) & (h->tablesize - 1);
+
+    return &h->table[i];
+}
+
+
+static void hash_grow(hash_t *h)
+{
+    int tablesize = (h->tablesize) ? h->tablesize * 2 : 1024;
+    int *table = calloc(tablesize, sizeof(int));
     int i;
 
-    printf("Map at %p with %d entries:\n", v, getcount(v));
+    if (table == NULL) {
+        fprintf(stderr, "CheriTree: Unable to allocate memory");
+        exit(1);
+    }
 
-    for (i = 0; i < getcount(v); i++)
-        printf("%" PRIxADDR "-%" PRIxADDR "\n", range[i].start, range[i].end);
+    free(h->table);
+    h->table = table;
+    h->tablesize = tablesize;
+
+    for (i = 0; i < getcount(&h->elements); i++)
+        *hash_slot(h, cheritree_vec_get(&h->elements, i)) = i + 1;
 }
 
 
-void cheritree_map_reset(map_t *v)
+void *cheritree_hash_find(hash_t *h, const void *key)
 {
-    v->count = 0;
+    int *slot;
+
+    if (!h->table) return NULL;
+
+    slot = hash_slot(h, key);
+    return (*slot) ? cheritree_vec_get(&h->elements, *slot - 1) : NULL;
 }
 
 
-void cheritree_map_delete(map_t *v)
+void *cheritree_hash_add(hash_t *h, const void *key)
 {
-    cheritree_vec_delete(v);
+    void *element = cheritree_hash_find(h, key);
+    int *slot;
+
+    if (element) return element;
+
+    if ((getcount(&h->elements) + 1) * 2 > h->tablesize)
+        hash_grow(h);
+
+    slot = hash_slot(h, key);
+    element = cheritree_vec_alloc(&h->elements, 1);
+    memcpy(element, key, h->keysize);
+
+    *slot = getcount(&h->elements);
+    return element;
+}
+
+
+void cheritree_hash_delete(hash_t *h)
+{
+    cheritree_vec_delete(&h->elements);
+    free(h->table);
+    h->table = NULL;
+    h->tablesize = 0;
 }
 
 
@@ -164,25 +606,68 @@ void cheritree_map_delete(map_t *v)
  *  Note: Strings are referenced by offset to minimise the number
  *  of capabilities introduced. There is no need to support deletion
  *  since the address space is assumed to be relatively static.
+ *  Strings are held in fixed chunks that never move, so they can
+ *  be read without a lock while other strings are being added.
  */
 string_t cheritree_string_alloc(const char *s)
 {
-    char *addr;
+    size_t len;
+    string_t str;
 
     if (!s || !*s) return 0;
 
-    if (!strings.addr)
-        cheritree_vec_init(&strings, sizeof(char), 64 * 1024);
- 
-    addr = cheritree_vec_alloc(&strings, strlen(s) + 1);
+    if ((len = strlen(s) + 1) > STRING_CHUNKSIZE) {
+        fprintf(stderr, "CheriTree: String too long");
+        exit(1);
+    }
+
+    pthread_mutex_lock(&stringlock);
+
+    if (!nchunks || used + len > STRING_CHUNKSIZE) {
+        char *chunk = (nchunks < STRING_MAXCHUNKS) ?
+            malloc(STRING_CHUNKSIZE) : NULL;
 
-    return (string_t)(strcpy(addr, s) - strings.addr + 1);
+        if (chunk == NULL) {
+            fprintf(stderr, "CheriTree: Unable to allocate memory");
+            exit(1);
+        }
+
+        __atomic_store_n(&chunks[nchunks++], chunk, __ATOMIC_RELEASE);
+        used = 0;
+    }
+
+    memcpy(chunks[nchunks - 1] + used, s, len);
+    str = (string_t)((nchunks - 1) * STRING_CHUNKSIZE + used + 1);
+    used += len;
+
+    pthread_mutex_unlock(&stringlock);
+    return str;
 }
 
 
 const char *cheritree_string_get(string_t s)
 {
-    return (s) ? strings.addr + s - 1 : "";
+    if (!s) return "";
+
+    return __atomic_load_n(&chunks[(s - 1) / STRING_CHUNKSIZE],
+        __ATOMIC_ACQUIRE) + (s - 1) % STRING_CHUNKSIZE;
+}
+
+
+/*
+ *  Hold the retire and string locks across a fork.
+ */
+void cheritree_util_lock()
+{
+    pthread_mutex_lock(&retirelock);
+    pthread_mutex_lock(&stringlock);
+}
+
+
+void cheritree_util_unlock()
+{
+    pthread_mutex_unlock(&stringlock);
+    pthread_mutex_unlock(&retirelock);
 }
 
 
@@ -258,3 +743,28 @@ void cheritree_vec_delete(vec_t *v)
     v->count = 0;
     v->maxcount = 0;
 }
+
+
+/*
+ *  Process being inspected.
+ *
+ *  Note: The tables normally describe the calling process, but an
+ *  external tool can inspect another process, whose /proc files are
+ *  then read instead. It must be set before the tables are loaded.
+ */
+void cheritree_set_target(int pid)
+{
+    target = pid;
+}
+
+
+int cheritree_get_target()
+{
+    return (target) ? target : getpid();
+}
+
+
+int cheritree_is_remote()
+{
+    return target && target != getpid();
+}
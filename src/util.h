@@ -49,11 +49,28 @@ void cheritree_vec_trim(vec_t *v);
 void cheritree_vec_delete(vec_t *v);
 
 
+/*
+ *  Published versions of a vector.
+ *
+ *  Note: Shared tables are never updated in place. A new version
+ *  is built and published instead, so readers see either the old
+ *  or the new version without taking a lock. Readers bracket their
+ *  use with cheritree_read_begin() and cheritree_read_end(), and a
+ *  replaced version is only freed once all earlier readers finish.
+ */
+int cheritree_read_begin();
+void cheritree_read_end(int epoch);
+vec_t *cheritree_vec_current(vec_t **pv);
+void cheritree_vec_publish(vec_t **pv, vec_t *v);
+
+
 /*
  *  Map of address ranges, grown on demand.
  *
  *  Note: Integers are used instead of pointers to minimise the
- *  number of capabilities introduced.
+ *  number of capabilities introduced. Overlapping ranges are merged,
+ *  and the ranges are held in a treap with nodes referenced by index,
+ *  so adding or finding a range takes logarithmic time.
  */
 
 typedef struct range {
@@ -61,14 +78,42 @@ typedef struct range {
     addr_t end;         // End of range
 } range_t;
 
-typedef vec_t map_t;
+typedef struct map {
+    vec_t nodes;        // Array of nodes
+    int root;           // Root node (index + 1), or zero if empty
+    int free;           // Free nodes (index + 1)
+    int count;          // Ranges in map
+    unsigned seed;      // Priority generator
+} map_t;
+
+void cheritree_map_init(map_t *m, int expect);
+int cheritree_map_add(map_t *m, addr_t start, addr_t end);
+void cheritree_map_remove(map_t *m, addr_t start, addr_t end);
+int cheritree_map_find(map_t *m, addr_t addr, range_t *prange);
+int cheritree_map_next(map_t *m, addr_t addr, range_t *prange);
+void cheritree_map_print(map_t *m);
+void cheritree_map_reset(map_t *m);
+void cheritree_map_delete(map_t *m);
+
+
+/*
+ *  Hash of fixed size elements, grown on demand.
+ *
+ *  Note: The key is held at the start of each element. Elements
+ *  are stored in a linear vector and the table holds indexes, so
+ *  element pointers are only valid until the next addition.
+ */
+typedef struct hash {
+    vec_t elements;     // Array of elements
+    int *table;         // Element index + 1, or zero if empty
+    int tablesize;      // Table size (power of 2)
+    size_t keysize;     // Key size
+} hash_t;
 
-void cheritree_map_init(map_t *v, int expect);
-int cheritree_map_add(map_t *v, addr_t start, addr_t end);
-int cheritree_map_find(map_t *v, addr_t addr, range_t *prange);
-void cheritree_map_print(map_t *v);
-void cheritree_map_reset(map_t *v);
-void cheritree_map_delete(map_t *v);
+void cheritree_hash_init(hash_t *h, size_t size, size_t keysize, int expect);
+void *cheritree_hash_find(hash_t *h, const void *key);
+void *cheritree_hash_add(hash_t *h, const void *key);
+void cheritree_hash_delete(hash_t *h);
 
 
 /*
@@ -77,6 +122,8 @@ void cheritree_map_delete(map_t *v);
  *  Note: Strings are referenced by offset to minimise the number
  *  of capabilities introduced. There is no need to support deletion
  *  since the address space is assumed to be relatively static.
+ *  Strings are held in fixed chunks that never move, so they can
+ *  be read without a lock while other strings are being added.
  */
 typedef int string_t;
 
@@ -84,6 +131,16 @@ string_t cheritree_string_alloc(const char *s);
 const char *cheritree_string_get(string_t s);
 
 
+/*
+ *  Locks of the shared tables.
+ *
+ *  Note: The locks are held across a fork, so that the child can't
+ *  inherit a lock held by another thread.
+ */
+void cheritree_util_lock();
+void cheritree_util_unlock();
+
+
 /*
  *  Access functions.
  */
@@ -94,6 +151,14 @@ const char *cheritree_string_get(string_t s);
 #define setpath(x,s)    (x)->pathstr = cheritree_string_alloc((s))
 
 
+/*
+ *  Process being inspected.
+ */
+void cheritree_set_target(int pid);
+int cheritree_get_target();
+int cheritree_is_remote();
+
+
 /*
  *  Load array from command or path.
  */
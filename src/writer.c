@@ -0,0 +1,223 @@
+/*-
+ *  SPDX-License-Identifier: BSD-3-Clause
+ *
+ *  Copyright (c) 2023, rtegrity ltd. All rights reserved.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sched.h>
+#include <pthread.h>
+#include "writer.h"
+
+
+#define WRITER_SPIN         100     // Yields before blocking
+
+static struct ring {
+    char *addr;             // Array of records
+    size_t size;            // Record size
+    unsigned count;         // Number of records (power of 2)
+    unsigned head;          // Next record to write
+    unsigned tail;          // Next record to read
+    int done;               // No more records
+    int running;            // Writer thread started
+    int busy;               // Producer active
+    int waiting;            // Writer blocked while empty
+    int full;               // Producer blocked while full
+    pthread_t thread;       // Writer thread
+    pthread_mutex_t lock;   // Lock for blocking
+    pthread_cond_t ready;   // Records added or done
+    pthread_cond_t space;   // Records removed
+    void (*write)(void *record);
+} ring = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .ready = PTHREAD_COND_INITIALIZER,
+    .space = PTHREAD_COND_INITIALIZER
+};
+
+
+/*
+ *  Wake a thread blocked on the ring, if it has said that it is.
+ *
+ *  Note: The flag is set before the blocked thread checks the ring
+ *  again, and the ring is updated before the flag is checked here,
+ *  so either the thread sees the update or it is woken.
+ */
+static void wake_ring(int *pflag, pthread_cond_t *cond)
+{
+    if (!__atomic_load_n(pflag, __ATOMIC_SEQ_CST)) return;
+
+    pthread_mutex_lock(&ring.lock);
+    pthread_cond_signal(cond);
+    pthread_mutex_unlock(&ring.lock);
+}
+
+
+static int is_empty(unsigned tail)
+{
+    return tail == __atomic_load_n(&ring.head, __ATOMIC_SEQ_CST) &&
+        !__atomic_load_n(&ring.done, __ATOMIC_SEQ_CST);
+}
+
+
+static int is_full(unsigned head)
+{
+    return head - __atomic_load_n(&ring.tail, __ATOMIC_SEQ_CST) == ring.count;
+}
+
+
+static void *run_writer(void *arg)
+{
+    unsigned tail;
+    int i;
+
+    (void)arg;
+
+    for (tail = ring.tail;; tail++) {
+        for (i = 0; i < WRITER_SPIN && is_empty(tail); i++)
+            sched_yield();
+
+        if (is_empty(tail)) {
+            pthread_mutex_lock(&ring.lock);
+            __atomic_store_n(&ring.waiting, 1, __ATOMIC_SEQ_CST);
+
+            while (is_empty(tail))
+                pthread_cond_wait(&ring.ready, &ring.lock);
+
+            __atomic_store_n(&ring.waiting, 0, __ATOMIC_SEQ_CST);
+            pthread_mutex_unlock(&ring.lock);
+        }
+
+        if (tail == __atomic_load_n(&ring.head, __ATOMIC_SEQ_CST)) {
+            fflush(stdout);
+            return NULL;
+        }
+
+        ring.write(ring.addr + (tail & (ring.count - 1)) * ring.size);
+        __atomic_store_n(&ring.tail, tail + 1, __ATOMIC_SEQ_CST);
+        wake_ring(&ring.full, &ring.space);
+    }
+}
+
+
+static void finish_ring()
+{
+    __atomic_store_n(&ring.done, 1, __ATOMIC_SEQ_CST);
+    wake_ring(&ring.waiting, &ring.ready);
+}
+
+
+static void join_writer()
+{
+    if (!ring.running) return;
+
+    finish_ring();
+    pthread_join(ring.thread, NULL);
+
+    free(ring.addr);
+    ring.addr = NULL;
+    ring.running = 0;
+}
+
+
+static int claim_writer()
+{
+    int idle = 0;
+
+    return __atomic_compare_exchange_n(&ring.busy, &idle, 1,
+        0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED);
+}
+
+
+static void release_writer()
+{
+    __atomic_store_n(&ring.busy, 0, __ATOMIC_RELEASE);
+}
+
+
+/*
+ *  Start the writer thread, finishing any previous output.
+ *  The count must be a power of 2.
+ */
+int cheritree_writer_start(size_t size, int count, void (*write)(void *record))
+{
+    if (!claim_writer()) return 0;
+
+    join_writer();
+
+    if ((ring.addr = malloc(size * count)) == NULL) {
+        release_writer();
+        return 0;
+    }
+
+    ring.size = size;
+    ring.count = count;
+    ring.head = ring.tail = 0;
+    ring.done = 0;
+    ring.write = write;
+
+    fflush(stdout);
+
+    if (pthread_create(&ring.thread, NULL, run_writer, NULL) != 0) {
+        free(ring.addr);
+        ring.addr = NULL;
+        release_writer();
+        return 0;
+    }
+
+    ring.running = 1;
+    return 1;
+}
+
+
+/*
+ *  Add a record, waiting only if the ring is full.
+ */
+void cheritree_writer_push(const void *record)
+{
+    unsigned head = ring.head;
+    int i;
+
+    for (i = 0; i < WRITER_SPIN && is_full(head); i++)
+        sched_yield();
+
+    if (is_full(head)) {
+        pthread_mutex_lock(&ring.lock);
+        __atomic_store_n(&ring.full, 1, __ATOMIC_SEQ_CST);
+
+        while (is_full(head))
+            pthread_cond_wait(&ring.space, &ring.lock);
+
+        __atomic_store_n(&ring.full, 0, __ATOMIC_SEQ_CST);
+        pthread_mutex_unlock(&ring.lock);
+    }
+
+    memcpy(ring.addr + (head & (ring.count - 1)) * ring.size, record, ring.size);
+    __atomic_store_n(&ring.head, head + 1, __ATOMIC_SEQ_CST);
+    wake_ring(&ring.waiting, &ring.ready);
+}
+
+
+/*
+ *  Finish adding records, leaving the writer to complete.
+ */
+void cheritree_writer_finish()
+{
+    finish_ring();
+    release_writer();
+}
+
+
+/*
+ *  Wait for the writer thread to finish, including
+ *  any producer that is still adding records.
+ */
+void cheritree_writer_flush()
+{
+    while (!claim_writer())
+        sched_yield();
+
+    join_writer();
+    release_writer();
+}
@@ -0,0 +1,29 @@
+/*-
+ *  SPDX-License-Identifier: BSD-3-Clause
+ *
+ *  Copyright (c) 2023, rtegrity ltd. All rights reserved.
+ */
+
+#ifndef _CHERITREE_WRITER_H_
+#define _CHERITREE_WRITER_H_
+
+#include <stddef.h>
+
+
+/*
+ *  Background writer.
+ *
+ *  Note: Records are passed to the writer thread through a single
+ *  producer, single consumer ring, so the producer only waits when
+ *  the ring is full. Either side yields briefly and then blocks on a
+ *  condition variable, so an idle writer doesn't use a core. Only one
+ *  producer can use the ring at a time, so starting fails while
+ *  another producer is active.
+ */
+int cheritree_writer_start(size_t size, int count, void (*write)(void *record));
+void cheritree_writer_push(const void *record);
+void cheritree_writer_finish();
+void cheritree_writer_flush();
+
+
+#endif /* _CHERITREE_WRITER_H_ */
@@ -0,0 +1,587 @@
+/*-
+ *  SPDX-License-Identifier: BSD-3-Clause
+ *
+ *  Copyright (c) 2023, rtegrity ltd. All rights reserved.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <limits.h>
+#include <pthread.h>
+#include "symbol.h"
+#include "util.h"
+
+
+/*
+ *  Aggregate capability dumps from many processes.
+ *
+ *  Note: Each dump holds the output of cheritree_print_mappings()
+ *  followed by one or more trees printed with CHERITREE_OPT_RAW.
+ *  Dumps are read a line at a time by a pool of threads, so memory
+ *  use depends on the number of distinct images and symbols rather
+ *  than the size of the dumps. Each capability is normalised to the
+ *  image, symbol and offset it refers to, using the symbols of the
+ *  images on this system (or under the root given with -r), and the
+ *  totals of each thread are merged once all dumps have been read.
+ *  Usage: cheritree-aggregate [-j threads] [-n top] [-r root] dump...
+ */
+typedef uint64_t name_t;    // Hash of name
+
+typedef struct dumpmap {
+    addr_t start;           // Start address
+    addr_t end;             // End address
+    addr_t base;            // Start of image
+    int path;               // Offset of path in dump paths
+    int symbols;            // Symbols can be loaded
+    name_t image;           // Image name
+} dumpmap_t;
+
+typedef struct intern {
+    name_t key;             // Hash of name
+    string_t namestr;       // Name string
+} intern_t;
+
+typedef struct pair {
+    name_t from;            // Image holding capabilities
+    name_t to;              // Image referred to
+    long count;             // Number of capabilities
+    addr_t length;          // Total length of bounds
+    int processes;          // Number of dumps
+    int last;               // Last dump counted
+} pair_t;
+
+typedef struct reach {
+    name_t root;            // Image referred to by the root
+    name_t image;           // Image reached
+    long count;             // Number of capabilities
+    addr_t length;          // Total length of bounds
+    int processes;          // Number of dumps
+    int last;               // Last dump counted
+} reach_t;
+
+typedef struct target {
+    name_t image;           // Image referred to
+    name_t symbol;          // Symbol, or zero if none
+    addr_t offset;          // Offset from symbol or image
+    long count;             // Number of capabilities
+    addr_t length;          // Total length of bounds
+    int processes;          // Number of dumps
+    int last;               // Last dump counted
+} target_t;
+
+typedef struct totals {
+    hash_t names;           // Interned names
+    hash_t pairs;           // Capabilities between images
+    hash_t reaches;         // Images reachable from each root
+    hash_t targets;         // Capabilities to each symbol
+    long capabilities;      // Capabilities read
+    int dumps;              // Dumps read
+} totals_t;
+
+typedef struct worker {
+    pthread_t thread;       // Thread
+    totals_t totals;        // Totals for dumps read
+    vec_t maps;             // Mappings of current dump
+    vec_t paths;            // Paths of current dump
+} worker_t;
+
+#define getdumpmap(v,i)     ((dumpmap_t *)cheritree_vec_get((v),(i)))
+#define getelement(h,i)     cheritree_vec_get(&(h)->elements,(i))
+#define getelements(h)      getcount(&(h)->elements)
+
+static char **dumps;
+static int ndumps;
+static int nextdump;
+static int ntop = 20;
+static const char *root = "";
+
+
+static name_t hash_name(const char *s)
+{
+    name_t hash = 14695981039346656037ull;
+
+    while (*s) hash = (hash ^ (unsigned char)*s++) * 1099511628211ull;
+    return hash;
+}
+
+
+static name_t intern_name(totals_t *totals, const char *s)
+{
+    name_t key = (*s) ? hash_name(s) : 0;
+    intern_t *intern;
+
+    if (!key) return 0;
+
+    intern = (intern_t *)cheritree_hash_add(&totals->names, &key);
+    if (!intern->namestr) intern->namestr = cheritree_string_alloc(s);
+
+    return key;
+}
+
+
+static const char *get_name(totals_t *totals, name_t key, const char *none)
+{
+    intern_t *intern = (key) ?
+        (intern_t *)cheritree_hash_find(&totals->names, &key) : NULL;
+
+    return (intern) ? cheritree_string_get(intern->namestr) : none;
+}
+
+
+static void init_totals(totals_t *totals)
+{
+    cheritree_hash_init(&totals->names, sizeof(intern_t), sizeof(name_t), 256);
+    cheritree_hash_init(&totals->pairs, sizeof(pair_t), 2 * sizeof(name_t), 256);
+    cheritree_hash_init(&totals->reaches, sizeof(reach_t), 2 * sizeof(name_t), 256);
+    cheritree_hash_init(&totals->targets, sizeof(target_t),
+        2 * sizeof(name_t) + sizeof(addr_t), 1024);
+    totals->capabilities = 0;
+    totals->dumps = 0;
+}
+
+
+static void delete_totals(totals_t *totals)
+{
+    cheritree_hash_delete(&totals->names);
+    cheritree_hash_delete(&totals->pairs);
+    cheritree_hash_delete(&totals->reaches);
+    cheritree_hash_delete(&totals->targets);
+}
+
+
+/*
+ *  Parse a mapping printed by cheritree_print_mappings().
+ *
+ *  Note: The path (or name) is the last field before the base.
+ *  Images are named by the last component of their path, so that
+ *  the same library is identified in every dump.
+ */
+static int load_dumpmap(worker_t *w, const char *line)
+{
+    const char *cp = line, *end, *path;
+    char *ep, local[PATH_MAX];
+    dumpmap_t *map;
+    addr_t start, base;
+
+    if (strncmp(cp, "0x", 2)) return 0;
+
+    start = strtoull(cp, &ep, 16);
+    if (*ep != '-' || (end = strstr(ep, " [base ")) == NULL) return 0;
+
+    for (path = end; path > ep && path[-1] != ' '; path--);
+    base = strtoull(end + 7, NULL, 16);
+
+    map = (dumpmap_t *)cheritree_vec_alloc(&w->maps, 1);
+    map->start = start;
+    map->end = strtoull(ep + 1, NULL, 16);
+    map->base = base;
+    map->path = getcount(&w->paths);
+
+    memcpy(cheritree_vec_alloc(&w->paths, end - path + 1), path, end - path);
+    w->paths.addr[getcount(&w->paths) - 1] = 0;
+
+    cp = strrchr(w->paths.addr + map->path, '/');
+    map->image = intern_name(&w->totals, (cp) ? cp + 1 :
+        (path < end) ? w->paths.addr + map->path : "[anon]");
+
+    if (*path == '/') {
+        snprintf(local, sizeof(local), "%s%s", root, w->paths.addr + map->path);
+        if ((map->symbols = !access(local, R_OK)) != 0)
+            cheritree_load_symbols(local);
+    }
+
+    return 1;
+}
+
+
+static dumpmap_t *find_dumpmap(worker_t *w, addr_t addr)
+{
+    int low = 0, high = getcount(&w->maps);
+
+    while (low < high) {
+        int mid = low + (high - low) / 2;
+        dumpmap_t *map = getdumpmap(&w->maps, mid);
+
+        if (addr < map->start) high = mid;
+        else if (addr >= map->end) low = mid + 1;
+        else return map;
+    }
+
+    return NULL;
+}
+
+
+/*
+ *  Normalise an address to its image, symbol and offset.
+ *
+ *  Note: Symbols are only found for images that exist locally, and
+ *  addresses in other mappings have no offset since their layout
+ *  differs between processes.
+ */
+static void normalise(worker_t *w, addr_t addr, target_t *key)
+{
+    dumpmap_t *map = find_dumpmap(w, addr);
+    char path[PATH_MAX], buf[SYMBOL_NAMELEN];
+    symbol_t symbol;
+
+    memset(key, 0, sizeof(*key));
+
+    if (!map) return;
+
+    key->image = map->image;
+    if (w->paths.addr[map->path] != '/') return;
+
+    key->offset = addr - map->base;
+    if (!map->symbols) return;
+
+    snprintf(path, sizeof(path), "%s%s", root, w->paths.addr + map->path);
+    if (!cheritree_find_symbol(path, map->base, addr, &symbol)) return;
+
+    key->symbol = intern_name(&w->totals,
+        cheritree_symbol_name(&symbol, buf, sizeof(buf)));
+    key->offset = addr - map->base - symbol.value;
+}
+
+
+/*
+ *  Parse the capability following the name or location.
+ *
+ *  Note: The bounds are the last range within the brackets, so
+ *  that both native and emulated output can be read.
+ */
+static int parse_capability(const char *cp, addr_t *paddr, addr_t *plength)
+{
+    const char *bounds = strchr(cp, '['), *close;
+    addr_t base, top;
+    char *ep;
+
+    *paddr = strtoull(cp, &ep, 16);
+    if (ep == cp || !bounds || (close = strchr(bounds, ']')) == NULL)
+        return 0;
+
+    for (cp = close; cp > bounds && cp[-1] != ',' && cp[-1] != '['; cp--);
+
+    base = strtoull(cp, &ep, 16);
+    top = (*ep == '-') ? strtoull(ep + 1, NULL, 16) : base;
+
+    *plength = (top > base) ? top - base : 0;
+    return 1;
+}
+
+
+static void add_pair(worker_t *w, name_t from, name_t to, addr_t length, int dump)
+{
+    name_t key[2] = { from, to };
+    pair_t *pair;
+
+    if (from == to) return;
+
+    pair = (pair_t *)cheritree_hash_add(&w->totals.pairs, key);
+    pair->count++;
+    pair->length += length;
+
+    if (pair->last != dump) {
+        pair->last = dump;
+        pair->processes++;
+    }
+}
+
+
+static void add_reach(worker_t *w, name_t from, name_t to, addr_t length, int dump)
+{
+    name_t key[2] = { from, to };
+    reach_t *reach = (reach_t *)cheritree_hash_add(&w->totals.reaches, key);
+
+    reach->count++;
+    reach->length += length;
+
+    if (reach->last != dump) {
+        reach->last = dump;
+        reach->processes++;
+    }
+}
+
+
+static void add_target(worker_t *w, target_t *key, addr_t length, int dump)
+{
+    target_t *target = (target_t *)cheritree_hash_add(&w->totals.targets, key);
+
+    target->count++;
+    target->length += length;
+
+    if (target->last != dump) {
+        target->last = dump;
+        target->processes++;
+    }
+}
+
+
+/*
+ *  Read a dump, a line at a time.
+ *
+ *  Note: Each line of a tree is indented by its depth. A root is
+ *  printed with its name, and every other capability with the
+ *  location holding it, so each line is handled on its own.
+ */
+static void read_dump(worker_t *w, int dump)
+{
+    const char *path = dumps[dump];
+    FILE *fp = fopen(path, "r");
+    name_t compartment = 0;
+    size_t size = 0;
+    char *line = NULL;
+    int epoch;
+
+    if (fp == NULL) {
+        fprintf(stderr, "Unable to open %s\n", path);
+        exit(1);
+    }
+
+    getcount(&w->maps) = 0;
+    getcount(&w->paths) = 0;
+    epoch = cheritree_read_begin();
+
+    while (getline(&line, &size, fp) > 0) {
+        addr_t addr, origin, length;
+        target_t key, source;
+        char *cp = line, *ep;
+        int depth;
+
+        if (load_dumpmap(w, line)) continue;
+
+        for (depth = 0; *cp == ' '; depth++, cp++);
+
+        if (depth) {
+            origin = strtoull(cp, &ep, 16);
+            if (*ep != ':') continue;
+            cp = ep + 1;
+        }
+
+        else if ((cp = strchr(cp, ' ')) == NULL) continue;
+
+        if (!parse_capability(cp, &addr, &length)) continue;
+
+        normalise(w, addr, &key);
+        w->totals.capabilities++;
+
+        if (!depth) compartment = key.image;
+
+        else {
+            normalise(w, origin, &source);
+            add_pair(w, source.image, key.image, length, dump + 1);
+        }
+
+        add_reach(w, compartment, key.image, length, dump + 1);
+        add_target(w, &key, length, dump + 1);
+    }
+
+    cheritree_read_end(epoch);
+    w->totals.dumps++;
+
+    free(line);
+    fclose(fp);
+}
+
+
+static void *run_worker(void *arg)
+{
+    worker_t *w = (worker_t *)arg;
+    int dump;
+
+    while ((dump = __atomic_fetch_add(&nextdump, 1, __ATOMIC_RELAXED)) < ndumps)
+        read_dump(w, dump);
+
+    return NULL;
+}
+
+
+/*
+ *  Merge the totals of a worker.
+ *
+ *  Note: Each dump is read by a single worker, so the number of
+ *  processes can be added.
+ */
+static void merge_totals(totals_t *totals, totals_t *from)
+{
+    int i;
+
+    for (i = 0; i < getelements(&from->names); i++) {
+        intern_t *ip = (intern_t *)getelement(&from->names, i);
+        intern_t *intern = (intern_t *)cheritree_hash_add(&totals->names, &ip->key);
+
+        if (!intern->namestr) intern->namestr = ip->namestr;
+    }
+
+    for (i = 0; i < getelements(&from->pairs); i++) {
+        pair_t *pp = (pair_t *)getelement(&from->pairs, i);
+        pair_t *pair = (pair_t *)cheritree_hash_add(&totals->pairs, pp);
+
+        pair->count += pp->count;
+        pair->length += pp->length;
+        pair->processes += pp->processes;
+    }
+
+    for (i = 0; i < getelements(&from->reaches); i++) {
+        reach_t *rp = (reach_t *)getelement(&from->reaches, i);
+        reach_t *reach = (reach_t *)cheritree_hash_add(&totals->reaches, rp);
+
+        reach->count += rp->count;
+        reach->length += rp->length;
+        reach->processes += rp->processes;
+    }
+
+    for (i = 0; i < getelements(&from->targets); i++) {
+        target_t *tp = (target_t *)getelement(&from->targets, i);
+        target_t *target = (target_t *)cheritree_hash_add(&totals->targets, tp);
+
+        target->count += tp->count;
+        target->length += tp->length;
+        target->processes += tp->processes;
+    }
+
+    totals->capabilities += from->capabilities;
+    totals->dumps += from->dumps;
+}
+
+
+static int compare_pairs(const void *a, const void *b)
+{
+    const pair_t *pa = (const pair_t *)a, *pb = (const pair_t *)b;
+
+    if (pa->processes != pb->processes) return pb->processes - pa->processes;
+    return (pa->count < pb->count) - (pa->count > pb->count);
+}
+
+
+static int compare_reaches(const void *a, const void *b)
+{
+    const reach_t *ra = (const reach_t *)a, *rb = (const reach_t *)b;
+
+    if (ra->root != rb->root) return (ra->root > rb->root) - (ra->root < rb->root);
+    if (ra->processes != rb->processes) return rb->processes - ra->processes;
+    return (ra->count < rb->count) - (ra->count > rb->count);
+}
+
+
+static int compare_targets(const void *a, const void *b)
+{
+    const target_t *ta = (const target_t *)a, *tb = (const target_t *)b;
+
+    if (ta->count != tb->count) return (ta->count < tb->count) - (ta->count > tb->count);
+    return tb->processes - ta->processes;
+}
+
+
+static void print_totals(totals_t *t)
+{
+    int i;
+
+    // The hashes aren't used after this, so the elements are sorted in place
+
+    qsort(t->pairs.elements.addr, getelements(&t->pairs), sizeof(pair_t), compare_pairs);
+    qsort(t->reaches.elements.addr, getelements(&t->reaches), sizeof(reach_t), compare_reaches);
+    qsort(t->targets.elements.addr, getelements(&t->targets), sizeof(target_t), compare_targets);
+
+    printf("%ld capabilities in %d dumps\n\n", t->capabilities, t->dumps);
+    printf("Capabilities between images:\n");
+    printf("%10s %10s %18s  %s\n", "processes", "count", "bounds", "source -> target");
+
+    for (i = 0; i < getelements(&t->pairs); i++) {
+        pair_t *pp = (pair_t *)getelement(&t->pairs, i);
+
+        printf("%10d %10ld %#18" PRIxADDR "  %s -> %s\n", pp->processes,
+            pp->count, pp->length, get_name(t, pp->from, "[unmapped]"),
+            get_name(t, pp->to, "[unmapped]"));
+    }
+
+    printf("\nImages reachable from roots:\n");
+    printf("%10s %10s %18s  %s\n", "processes", "count", "bounds", "root -> image");
+
+    for (i = 0; i < getelements(&t->reaches); i++) {
+        reach_t *rp = (reach_t *)getelement(&t->reaches, i);
+
+        printf("%10d %10ld %#18" PRIxADDR "  %s -> %s\n", rp->processes,
+            rp->count, rp->length, get_name(t, rp->root, "[unmapped]"),
+            get_name(t, rp->image, "[unmapped]"));
+    }
+
+    printf("\nMost referenced targets:\n");
+    printf("%10s %10s %18s  %s\n", "processes", "count", "bounds", "target");
+
+    for (i = 0; i < getelements(&t->targets) && i < ntop; i++) {
+        target_t *tp = (target_t *)getelement(&t->targets, i);
+
+        printf("%10d %10ld %#18" PRIxADDR "  %s", tp->processes, tp->count,
+            tp->length, get_name(t, tp->image, "[unmapped]"));
+
+        if (tp->symbol) printf("!%s", get_name(t, tp->symbol, "?"));
+        if (tp->offset) printf("+%#" PRIxADDR, tp->offset);
+        putc('\n', stdout);
+    }
+}
+
+
+int main(int argc, char **argv)
+{
+    int nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+    worker_t *workers;
+    totals_t totals;
+    int c, i;
+
+    while ((c = getopt(argc, argv, "j:n:r:")) != -1) {
+        switch (c) {
+        case 'j': nthreads = atoi(optarg); break;
+        case 'n': ntop = atoi(optarg); break;
+        case 'r': root = optarg; break;
+
+        default:
+            fprintf(stderr, "Usage: %s [-j threads] [-n top] [-r root] dump...\n", argv[0]);
+            exit(1);
+        }
+    }
+
+    if (optind >= argc) {
+        fprintf(stderr, "Usage: %s [-j threads] [-n top] [-r root] dump...\n", argv[0]);
+        exit(1);
+    }
+
+    dumps = &argv[optind];
+    ndumps = argc - optind;
+
+    if (nthreads < 1) nthreads = 1;
+    if (nthreads > ndumps) nthreads = ndumps;
+
+    if ((workers = calloc(nthreads, sizeof(worker_t))) == NULL) {
+        fprintf(stderr, "Unable to allocate memory\n");
+        exit(1);
+    }
+
+    for (i = 0; i < nthreads; i++) {
+        init_totals(&workers[i].totals);
+        cheritree_vec_init(&workers[i].maps, sizeof(dumpmap_t), 256);
+        cheritree_vec_init(&workers[i].paths, 1, 16384);
+
+        if (pthread_create(&workers[i].thread, NULL, run_worker, &workers[i])) {
+            fprintf(stderr, "Unable to create thread\n");
+            exit(1);
+        }
+    }
+
+    init_totals(&totals);
+
+    for (i = 0; i < nthreads; i++) {
+        pthread_join(workers[i].thread, NULL);
+        merge_totals(&totals, &workers[i].totals);
+
+        delete_totals(&workers[i].totals);
+        cheritree_vec_delete(&workers[i].maps);
+        cheritree_vec_delete(&workers[i].paths);
+    }
+
+    print_totals(&totals);
+    delete_totals(&totals);
+    free(workers);
+    return 0;
+}
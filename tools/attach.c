@@ -0,0 +1,243 @@
+/*-
+ *  SPDX-License-Identifier: BSD-3-Clause
+ *
+ *  Copyright (c) 2023, rtegrity ltd. All rights reserved.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <elf.h>
+#include <sys/ptrace.h>
+#include <sys/uio.h>
+#include <sys/user.h>
+#include <sys/wait.h>
+#include <cheritree.h>
+#include "cap.h"
+#include "util.h"
+
+
+/*
+ *  Inspect another process (Linux, without CHERI).
+ *
+ *  Note: Every thread of the process is stopped with ptrace while it
+ *  is inspected, and the registers of the main thread are used as
+ *  the roots. Memory is read through a page cache, which is filled
+ *  with batches of consecutive pages by process_vm_readv(), and the
+ *  traversal runs in this process against the cache, so nothing is
+ *  added to the process being inspected. Without tags, any address
+ *  within a readable mapping is treated as a pointer.
+ *  Usage: cheritree-attach [tree|summary|leaks] pid
+ */
+#define CACHE_PAGES     4096
+#define CACHE_BATCH     64
+#define MAX_THREADS     1024
+#define NREGS           32
+
+#define CACHE_READ      1       // Page has been read
+#define CACHE_FAILED    2       // Page can't be read
+
+static pid_t pid;
+static pid_t threads[MAX_THREADS];
+static int nthreads;
+static char *cache;
+static addr_t tags[CACHE_PAGES];
+static addr_t pagesize;
+
+
+/*
+ *  Read consecutive pages into the cache, from the page that
+ *  missed. Pages after the first that can't be read are left.
+ */
+static int fill_cache(addr_t page)
+{
+    struct iovec local[CACHE_BATCH], remote;
+    ssize_t len;
+    int i, n;
+
+    for (i = 0; i < CACHE_BATCH; i++) {
+        local[i].iov_base = cache + ((page / pagesize + i) % CACHE_PAGES) * pagesize;
+        local[i].iov_len = pagesize;
+    }
+
+    remote.iov_base = (void *)(uintptr_t)page;
+    remote.iov_len = CACHE_BATCH * pagesize;
+
+    len = process_vm_readv(pid, local, CACHE_BATCH, &remote, 1, 0);
+    n = (len > 0) ? len / pagesize : 0;
+
+    for (i = 0; i < n; i++)
+        tags[(page / pagesize + i) % CACHE_PAGES] = (page + i * pagesize) | CACHE_READ;
+
+    if (!n) tags[(page / pagesize) % CACHE_PAGES] = page | CACHE_FAILED;
+    return (n > 0);
+}
+
+
+static int read_memory(addr_t addr, void *buf, size_t len)
+{
+    char *cp = (char *)buf;
+
+    while (len) {
+        addr_t page = addr & ~(pagesize - 1), offset = addr - page;
+        size_t n = (len < pagesize - offset) ? len : pagesize - offset;
+        addr_t tag = tags[(page / pagesize) % CACHE_PAGES];
+
+        if (tag == (page | CACHE_FAILED)) return 0;
+        if (tag != (page | CACHE_READ) && !fill_cache(page)) return 0;
+
+        memcpy(cp, cache + ((page / pagesize) % CACHE_PAGES) * pagesize + offset, n);
+        cp += n;
+        addr += n;
+        len -= n;
+    }
+
+    return 1;
+}
+
+
+/*
+ *  Stop a thread, returning zero if it can't be stopped.
+ */
+static int stop_thread(pid_t tid)
+{
+    int status;
+
+    if (ptrace(PTRACE_SEIZE, tid, 0, 0) != 0) return 0;
+
+    if (ptrace(PTRACE_INTERRUPT, tid, 0, 0) != 0 ||
+            waitpid(tid, &status, __WALL) != tid) {
+        ptrace(PTRACE_DETACH, tid, 0, 0);
+        return 0;
+    }
+
+    threads[nthreads++] = tid;
+    return 1;
+}
+
+
+/*
+ *  Stop every thread of the process.
+ *
+ *  Note: Threads created while the threads are being stopped are
+ *  missed, so the list is read until no new threads are found.
+ */
+static int stop_threads()
+{
+    char path[64];
+    struct dirent *dp;
+    int i, found;
+    DIR *dir;
+
+    sprintf(path, "/proc/%d/task", pid);
+
+    do {
+        if ((dir = opendir(path)) == NULL) return 0;
+
+        for (found = 0; (dp = readdir(dir)) != NULL && nthreads < MAX_THREADS; ) {
+            pid_t tid = atoi(dp->d_name);
+
+            if (tid <= 0) continue;
+
+            for (i = 0; i < nthreads && threads[i] != tid; i++);
+            if (i == nthreads && stop_thread(tid)) found++;
+        }
+
+        closedir(dir);
+    } while (found && nthreads < MAX_THREADS);
+
+    return (nthreads > 0);
+}
+
+
+static void resume_threads()
+{
+    int i;
+
+    for (i = 0; i < nthreads; i++)
+        ptrace(PTRACE_DETACH, threads[i], 0, 0);
+}
+
+
+/*
+ *  Get the registers of the main thread, in the layout saved by
+ *  the stubs, with the stack pointer in place of the DDC.
+ */
+static int get_registers(addr_t *regs)
+{
+#if defined(__x86_64__)
+    struct user_regs_struct r;
+    struct iovec iov = { &r, sizeof(r) };
+
+    if (ptrace(PTRACE_GETREGSET, pid, NT_PRSTATUS, &iov) != 0) return 0;
+
+    regs[0] = r.rdi; regs[1] = r.rsi; regs[2] = r.rdx; regs[3] = r.rcx;
+    regs[4] = r.r8; regs[5] = r.r9; regs[6] = r.rax; regs[7] = r.rbx;
+    regs[8] = r.r10; regs[9] = r.r11; regs[10] = r.r12; regs[11] = r.r13;
+    regs[12] = r.r14; regs[13] = r.r15;
+    regs[29] = r.rbp;
+    regs[30] = r.rip;
+    regs[31] = r.rsp;
+    return 1;
+#elif defined(__aarch64__)
+    struct user_regs_struct r;
+    struct iovec iov = { &r, sizeof(r) };
+    int i;
+
+    if (ptrace(PTRACE_GETREGSET, pid, NT_PRSTATUS, &iov) != 0) return 0;
+
+    for (i = 0; i < 31; i++) regs[i] = r.regs[i];
+    regs[31] = r.sp;
+    return 1;
+#else
+    return 0;
+#endif
+}
+
+
+int main(int argc, char **argv)
+{
+    const char *mode = (argc > 2) ? argv[1] : "tree";
+    addr_t regs[NREGS];
+
+    if (argc < 2 || argc > 3 || (pid = atoi(argv[argc - 1])) <= 0) {
+        fprintf(stderr, "Usage: %s [tree|summary|leaks] pid\n", argv[0]);
+        exit(1);
+    }
+
+    pagesize = getpagesize();
+    cache = malloc(CACHE_PAGES * pagesize);
+
+    if (cache == NULL) {
+        fprintf(stderr, "Unable to allocate memory\n");
+        exit(1);
+    }
+
+    if (!stop_threads()) {
+        fprintf(stderr, "Unable to attach to %d\n", pid);
+        exit(1);
+    }
+
+    memset(regs, 0, sizeof(regs));
+
+    if (!get_registers(regs)) {
+        fprintf(stderr, "Unable to get registers of %d\n", pid);
+        resume_threads();
+        exit(1);
+    }
+
+    cheritree_set_target(pid);
+    cheritree_emulate_remote(read_memory);
+    cheritree_emulate_registers((void **)regs, NREGS);
+
+    if (!strcmp(mode, "summary")) cheritree_print_summary();
+    else if (!strcmp(mode, "leaks")) cheritree_print_leaks();
+    else cheritree_print_capabilities();
+
+    resume_threads();
+    free(cache);
+    return 0;
+}